@@ -0,0 +1,35 @@
+#!/bin/bash
+# time the streaming kernels on emulators built with and without the
+# prefetch pass. CROSS names the riscv newlib toolchain, RUNS the number of
+# timed runs per kernel and build
+set -e
+cd "$(dirname "$0")"
+CROSS=${CROSS:-riscv64-unknown-elf-}
+CC=${CC:-clang}
+RUNS=${RUNS:-5}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+# stream steps one cache line pair at a time, stride skips across pages
+${CROSS}gcc -march=rv64imafd -mabi=lp64d -nostdlib -static -DSTEP=256 \
+    -o "$OUT/stream.elf" stream.S
+${CROSS}gcc -march=rv64imafd -mabi=lp64d -nostdlib -static -DSTEP=1088 \
+    -o "$OUT/stride.elf" stream.S
+
+for p in 0 1; do
+    $CC -O3 -DIR_PREFETCH=$p ../../src/*.c -lm -lpthread -o "$OUT/emu$p"
+done
+
+TIMEFORMAT=%R
+for k in stream stride; do
+    for p in 0 1; do
+        printf '%s prefetch=%d:' $k $p
+        for ((i = 0; i < RUNS; i++)); do
+            t=$( { time "$OUT/emu$p" "$OUT/$k.elf" > /dev/null; } 2>&1 )
+            printf ' %ss' "$t"
+        done
+        printf '\n'
+    done
+    # both builds have to agree on what the kernel read
+    cmp <("$OUT/emu0" "$OUT/$k.elf") <("$OUT/emu1" "$OUT/$k.elf")
+done
@@ -10,6 +10,9 @@ cache_t *new_cache() {
     cache->jitcode =
         (u8 *)mmap(NULL, CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+#if JIT_TRAP_DIV
+    trap_div_install(cache->jitcode, CACHE_SIZE);
+#endif
     return cache;
 }
 
@@ -26,7 +29,8 @@ u8 *cache_lookup(cache_t *cache, u64 pc) {
 
     while (cache->table[index].pc != 0) {
         if (cache->table[index].pc == pc) {
-            if (CACHE_IS_HOT)
+            // a hot pc may still be waiting for the compiler
+            if (cache->table[index].compiled)
                 return cache->jitcode + cache->table[index].offset;
             break;
         }
@@ -42,10 +46,22 @@ static inline u64 align_to(u64 val, u64 align) {
     return (val + align - 1) & ~(align - 1);
 }
 
-u8 *cache_add(cache_t *cache, u64 pc, u8 *code, size_t sz, u64 align) {
+/* copy code or data into the jit cache, without registering a block */
+u8 *cache_append(cache_t *cache, u8 *data, size_t sz, u64 align) {
     cache->offset = align_to(cache->offset, align);
     assert(cache->offset + sz <= CACHE_SIZE);
 
+    u8 *addr = cache->jitcode + cache->offset;
+    if (data == NULL)
+        memset(addr, 0, sz);
+    else
+        memcpy(addr, data, sz);
+    cache->offset += sz;
+    return addr;
+}
+
+/* register code placed by cache_append as the compiled block of pc */
+void cache_add(cache_t *cache, u64 pc, u8 *code, size_t sz) {
     u64 index = hash(pc);
     u64 search_count = 0;
     while (cache->table[index].pc != 0) {
@@ -57,14 +73,22 @@ u8 *cache_add(cache_t *cache, u64 pc, u8 *code, size_t sz, u64 align) {
 
         assert(++search_count <= MAX_SEARCH_COUNT);
     }
-    memcpy(cache->jitcode + cache->offset, code, sz);
     cache->table[index].pc = pc;
-    cache->table[index].offset = cache->offset;
-    cache->offset += sz;
+    cache->table[index].hot = CACHE_HOT_COUNT;
+    cache->table[index].compiled = true;
+    cache->table[index].offset = code - cache->jitcode;
     // flush instruction cache
-    sys_icache_invalidate(cache->jitcode + cache->table[index].offset, sz);
+    sys_icache_invalidate(code, sz);
+
+    // a re-formed region retires the code the ibtc still has for pc
+    u64 ibtc_index = CACHE_IBTC_HASH(pc);
+    if (cache->ibtc.table[ibtc_index].pc == pc)
+        cache->ibtc.table[ibtc_index].code = code;
 
-    return cache->jitcode + cache->table[index].offset;
+    // chain the exits of other blocks that were waiting for this one
+    for (u64 i = 0; i < cache->nlinks; i++) {
+        if (cache->link_pcs[i] == pc) cache->links[i] = code;
+    }
 }
 
 bool cache_hot(cache_t *cache, u64 pc) {
@@ -73,8 +97,8 @@ bool cache_hot(cache_t *cache, u64 pc) {
 
     while (cache->table[index].pc != 0) {
         if (cache->table[index].pc == pc) {
-            cache->table[index].hot =
-                MIN(++cache->table[index].hot, (u64)CACHE_HOT_COUNT);
+            // a hot pc keeps counting while it waits for the compiler
+            cache->table[index].hot++;
             return CACHE_IS_HOT;
         }
 
@@ -87,3 +111,137 @@ bool cache_hot(cache_t *cache, u64 pc) {
     cache->table[index].hot = 1;
     return false;
 }
+
+/* times pc was dispatched to before it had code, 0 if never */
+u64 cache_hotness(cache_t *cache, u64 pc) {
+    u64 index = hash(pc);
+
+    while (cache->table[index].pc != 0) {
+        if (cache->table[index].pc == pc) return cache->table[index].hot;
+        index++;
+        index = hash(index);
+    }
+    return 0;
+}
+
+/* reserve one exit slot per target pc for a block about to be generated, a
+ * slot for pc 0 stays unlinked */
+u8 **cache_alloc_links(cache_t *cache, u64 *pcs, u64 n) {
+    assert(cache->nlinks + n <= CACHE_LINK_SIZE);
+
+    u8 **links = cache->links + cache->nlinks;
+    for (u64 i = 0; i < n; i++) {
+        cache->link_pcs[cache->nlinks + i] = pcs[i];
+        links[i] = pcs[i] != 0 ? cache_lookup(cache, pcs[i]) : NULL;
+    }
+    cache->nlinks += n;
+    return links;
+}
+
+void cache_ibtc_add(cache_t *cache, u64 pc, u8 *code) {
+    u64 index = CACHE_IBTC_HASH(pc);
+    cache->ibtc.table[index].pc = pc;
+    cache->ibtc.table[index].code = code;
+}
+
+// room kept for one more block, covers the largest object a region makes
+#define CACHE_BLOCK_MAX (1024 * 1024)
+
+bool cache_full(cache_t *cache) {
+    return cache->offset + CACHE_BLOCK_MAX > CACHE_SIZE ||
+           cache->nlinks + CACHE_BLOCK_LINKS > CACHE_LINK_SIZE ||
+           cache->ncodes == CACHE_CODES;
+}
+
+/* evict every block, unlinking all chained exits first */
+void cache_flush(cache_t *cache) {
+    __atomic_store_n(&cache->ncodes, 0, __ATOMIC_RELEASE);
+    cache->epoch++;
+    memset(cache->links, 0, sizeof(cache->links));
+    cache->nlinks = 0;
+    memset(cache->ibtc.table, 0, sizeof(cache->ibtc.table));
+    memset(cache->table, 0, sizeof(cache->table));
+    cache->offset = 0;
+    // regions keep the targets they were re-formed with, not their code,
+    // a specialization needs its generic code, profiling starts over
+    for (u64 i = 0; i < CACHE_REGION_SIZE; i++) {
+        cache_region_t *region = &cache->regions[i];
+        region->text = NULL;
+        region->size = 0;
+        region->profile = NULL;
+        region->nprofiled = 0;
+        region->nspecs = 0;
+        region->generic = NULL;
+    }
+}
+
+/* the record of the region compiled for pc, direct-mapped */
+cache_region_t *cache_region(cache_t *cache, u64 pc) {
+    cache_region_t *region = &cache->regions[CACHE_REGION_HASH(pc)];
+    if (region->pc != pc) {
+        memset(region, 0, sizeof(cache_region_t));
+        region->pc = pc;
+    }
+    return region;
+}
+
+/* add target to what the region at pc is formed with, false if it was
+ * already part of it or the region cannot grow any more */
+bool cache_extend(cache_t *cache, u64 pc, u64 target) {
+    cache_region_t *region = cache_region(cache, pc);
+    if (region->nextends == CACHE_EXTENDS) return false;
+    for (u64 k = 0; k < region->nextends; k++) {
+        if (region->extends[k] == target) return false;
+    }
+    region->extends[region->nextends++] = target;
+    return true;
+}
+
+static int cache_marker_cmp(const void *a, const void *b) {
+    u8 *x = ((const cache_marker_t *)a)->code;
+    u8 *y = ((const cache_marker_t *)b)->code;
+    return x < y ? -1 : x > y;
+}
+
+/* publish the marker table of text compiled after all the others */
+void cache_add_code(cache_t *cache, u8 *text, u64 size,
+                    cache_marker_t *markers, u64 n) {
+    assert(cache->ncodes < CACHE_CODES);
+    qsort(markers, n, sizeof(cache_marker_t), cache_marker_cmp);
+
+    cache_code_t *code = &cache->codes[cache->ncodes];
+    code->text = text;
+    code->size = size;
+    code->markers = markers;
+    code->nmarkers = n;
+    __atomic_store_n(&cache->ncodes, cache->ncodes + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * the last marker at or before a host address in compiled code, or NULL.
+ * it neither locks nor allocates, signal handlers may call it
+ */
+cache_marker_t *cache_marker(cache_t *cache, u8 *ip) {
+    u64 lo = 0, hi = __atomic_load_n(&cache->ncodes, __ATOMIC_ACQUIRE);
+    while (lo < hi) {
+        u64 mid = (lo + hi) / 2;
+        if (cache->codes[mid].text <= ip)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0) return NULL;
+
+    cache_code_t *code = &cache->codes[lo - 1];
+    if (ip >= code->text + code->size) return NULL;
+    lo = 0;
+    hi = code->nmarkers;
+    while (lo < hi) {
+        u64 mid = (lo + hi) / 2;
+        if (code->markers[mid].code <= ip)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo == 0 ? NULL : &code->markers[lo - 1];
+}
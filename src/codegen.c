@@ -1,89 +1,340 @@
 #include "emulator.h"
 
+// guest registers passed in host registers between blocks
+static const int pinned[JIT_NPINNED] = JIT_PINNED_REGS;
+#define PINNED_REGS                                              \
+    (GP_REG(pinned[0]) | GP_REG(pinned[1]) | GP_REG(pinned[2]) | \
+     GP_REG(pinned[3]))
+
 // tracing program context
 typedef struct {
-    bool gp_reg[num_gp_regs];
-    bool fp_reg[num_fp_regs];
+    ir_region_t *ir;
+    u64 cur;      // region node being generated
+    u64 loop_pc;  // header of the loop being generated, or 0
+    bool unchecked;  // the loop was charged for all its trips on the way in
+    u64 nlinks;
+    u64 link_pcs[CACHE_BLOCK_LINKS];  // targets of the block's exit slots
+    u64 pc;         // pc the region is compiled for
+    bool extendable;  // count exits, the region can still be re-formed
 } tracer_t;
 
-static void tracer_reset(tracer_t *t) { memset(t, 0, sizeof(tracer_t)); }
+static void tracer_reset(tracer_t *t, ir_region_t *ir) {
+    memset(t, 0, sizeof(tracer_t));
+    t->ir = ir;
+}
 
-#define DEFINE_TRACE_USAGE(name)                               \
-    static void tracer_add_##name##_usage(tracer_t *t, ...) {  \
-        va_list ap;                                            \
-        va_start(ap, t);                                       \
-        int n;                                                 \
-        while ((n = va_arg(ap, int)) != -1) t->name[n] = true; \
-        va_end(ap);                                            \
-    }
+// once a block runs out of exit slots, the exits past them share its last
+// slot. it is never linked, they leave through the dispatcher
+#define TRACER_UNLINKED (CACHE_BLOCK_LINKS - 1)
 
-DEFINE_TRACE_USAGE(gp_reg);
-DEFINE_TRACE_USAGE(fp_reg);
+static u64 tracer_add_link(tracer_t *t, u64 pc) {
+    if (t->nlinks > TRACER_UNLINKED) return TRACER_UNLINKED;
+    t->link_pcs[t->nlinks] = t->nlinks == TRACER_UNLINKED ? 0 : pc;
+    return t->nlinks++;
+}
+
+static ir_insn_t *tracer_node(tracer_t *t) { return &t->ir->insns[t->cur]; }
+
+/* record the registers the generated code really reads and writes */
+static void tracer_read(tracer_t *t, u64 regs) {
+    ir_insn_t *node = tracer_node(t);
+    node->use |= regs & ~node->def;
+}
+
+static void tracer_write(tracer_t *t, u64 regs) { tracer_node(t)->def |= regs; }
+
+/* returns to a call site inside the block stay in the block */
+static str_t tracer_append_rets(tracer_t *t, str_t s) {
+    static char buf[128] = {0};
+
+    if (t->ir->nrets == 0) return s;
+
+    s = str_append(s, "    switch (target) {\n");
+    for (u64 i = 0; i < t->ir->nrets; i++) {
+        u64 pc = t->ir->ret_pcs[i];
+        if (t->ir->nslots > 0) {
+            // promoted stack slots hold only for the sp they assumed
+            sprintf(buf,
+                    "    case %luULL:\n"
+                    "        if (x%d == frame + (int64_t)%ldLL) goto "
+                    "insn_%lx;\n"
+                    "        break;\n",
+                    pc, sp, t->ir->insns[ir_find(t->ir, pc)].sp, pc);
+        } else {
+            sprintf(buf, "    case %luULL: goto insn_%lx;\n", pc, pc);
+        }
+        s = str_append(s, buf);
+    }
+    s = str_append(s, "    }\n");
+    return s;
+}
 
 static str_t tracer_append_prologue(tracer_t *t, str_t s) {
     static char buf[128] = {0};
 
+    u64 regs = 0;
+    for (u64 i = 0; i < t->ir->ninsns; i++) regs |= t->ir->insns[i].def;
+    u64 live = t->ir->insns[IR_NODE_ENTRY].live;
+    for (u64 k = 0; k < t->ir->nentries; k++)
+        live |= t->ir->insns[t->ir->entries[k]].live;
+    regs = (regs | live) & ~PINNED_REGS;
+    live &= ~PINNED_REGS;
+
     for (int i = 1; i < num_gp_regs; i++) {
-        if (!t->gp_reg[i]) continue;
-        sprintf(buf, "    uint64_t x%d = state->gp_regs[%d];\n", i, i);
+        if (live & GP_REG(i)) {
+            sprintf(buf, "    uint64_t x%d = state->gp_regs[%d];\n", i, i);
+        } else if (regs & GP_REG(i)) {
+            sprintf(buf, "    uint64_t x%d;\n", i);
+        } else {
+            continue;
+        }
         s = str_append(s, buf);
     }
 
     for (int i = 0; i < num_fp_regs; i++) {
-        if (!t->fp_reg[i]) continue;
-        sprintf(buf, "    fp_reg_t f%d = state->fp_regs[%d];\n", i, i);
+        if (live & FP_REG(i)) {
+            sprintf(buf, "    fp_reg_t f%d = state->fp_regs[%d];\n", i, i);
+        } else if (regs & FP_REG(i)) {
+            sprintf(buf, "    fp_reg_t f%d;\n", i);
+        } else {
+            continue;
+        }
+        s = str_append(s, buf);
+    }
+
+    // stack slots are addressed from sp at the entry
+    if (t->ir->nslots > 0) {
+        sprintf(buf, "    const uint64_t frame = x%d;\n", sp);
+        s = str_append(s, buf);
+    }
+    for (u64 k = 0; k < t->ir->nslots; k++) {
+        sprintf(buf,
+                "    uint64_t slot%lu = *(uint64_t *)TO_HOST(frame + "
+                "(int64_t)%ldLL);\n",
+                k, t->ir->slots[k]);
         s = str_append(s, buf);
     }
 
     return s;
 }
 
-static str_t tracer_append_epilogue(tracer_t *t, str_t s) {
+/* jump to the label an exported entry point stands for */
+static str_t tracer_append_entries(tracer_t *t, str_t s) {
+    static char buf[128] = {0};
+
+    if (t->ir->nentries == 0) return s;
+
+    s = str_append(s, "    switch (entry) {\n");
+    for (u64 k = 0; k < t->ir->nentries; k++) {
+        sprintf(buf, "    case %lu: goto insn_%lx;\n", k + 1,
+                t->ir->insns[t->ir->entries[k]].pc);
+        s = str_append(s, buf);
+    }
+    s = str_append(s, "    }\n");
+    return s;
+}
+
+/* a register's value as seen by an exported entry point */
+static const char *tracer_entry_reg(int reg) {
+    static char buf[32] = {0};
+    bool is_pinned = false;
+    for (int k = 0; k < JIT_NPINNED; k++) is_pinned |= pinned[k] == reg;
+    if (is_pinned)
+        sprintf(buf, "x%d", reg);
+    else
+        sprintf(buf, "state->gp_regs[%d]", reg);
+    return buf;
+}
+
+// the entry profile is complete, leave for the dispatcher before running,
+// the pinned registers are stored back in between
+#define CODEGEN_PROFILED                     \
+    "        if (++profile[0] == %dULL) {\n" \
+    "            *(uint64_t *)%luULL = %luULL;\n"
+
+#define CODEGEN_PROFILED_EXIT                        \
+    "            state->exit_reason = DIRECT_JMP;\n" \
+    "            state->reenter_pc = %luULL;\n"      \
+    "            return;\n"                          \
+    "        }\n"                                    \
+    "    }\n"
+
+/*
+ * count how often each register live into the region changes its value over
+ * the first entries, then return to the dispatcher once to let it specialize
+ * the region on the ones that hardly ever did
+ */
+static str_t tracer_append_profile(tracer_t *t, str_t s, cache_t *cache,
+                                   cache_region_t *region) {
+    static char buf[256] = {0};
+
+    u64 live = t->ir->insns[IR_NODE_ENTRY].live;
+    region->nprofiled = 0;
+    for (int i = 1; i < num_gp_regs && region->nprofiled < CACHE_SPECS; i++) {
+        if (live & GP_REG(i)) region->profiled[region->nprofiled++] = i;
+    }
+    if (region->nprofiled == 0) return s;
+
+    region->profile = (u64 *)cache_append(
+        cache, NULL, (1 + 2 * region->nprofiled) * sizeof(u64), sizeof(u64));
+    sprintf(buf,
+            "    uint64_t *profile = (uint64_t *)%luULL;\n"
+            "    if (profile[0] < %dULL) {\n",
+            (u64)region->profile, CACHE_PROFILE_COUNT);
+    s = str_append(s, buf);
+    for (u64 k = 0; k < region->nprofiled; k++) {
+        const char *val = tracer_entry_reg(region->profiled[k]);
+        sprintf(buf,
+                "        if (%s != profile[%lu]) {\n"
+                "            profile[%lu] = %s;\n"
+                "            profile[%lu]++;\n"
+                "        }\n",
+                val, 1 + 2 * k, 1 + 2 * k, val, 2 + 2 * k);
+        s = str_append(s, buf);
+    }
+    sprintf(buf, CODEGEN_PROFILED, CACHE_PROFILE_COUNT, (u64)&cache->specialize,
+            t->pc);
+    s = str_append(s, buf);
+    for (int k = 0; k < JIT_NPINNED; k++) {
+        sprintf(buf, "            state->gp_regs[%d] = x%d;\n", pinned[k],
+                pinned[k]);
+        s = str_append(s, buf);
+    }
+    sprintf(buf, CODEGEN_PROFILED_EXIT, t->pc);
+    return str_append(s, buf);
+}
+
+/* a specialized region runs only for the values it was specialized on */
+static str_t tracer_append_guard(tracer_t *t, str_t s,
+                                 cache_region_t *region) {
+    static char buf[128] = {0};
+
+    s = str_append(s, "    if (");
+    for (u64 k = 0; k < region->nspecs; k++) {
+        sprintf(buf, "%s%s != %luULL", k == 0 ? "" : " ||\n        ",
+                tracer_entry_reg(region->spec_regs[k]), region->spec_vals[k]);
+        s = str_append(s, buf);
+    }
+    sprintf(buf,
+            ") {\n"
+            "        ((block_func_t)%luULL)(state, x%d, x%d, x%d, x%d);\n"
+            "        return;\n"
+            "    }\n",
+            (u64)region->generic, pinned[0], pinned[1], pinned[2], pinned[3]);
+    return str_append(s, buf);
+}
+
+/* the hot exit targets taken in come back in through the indirect exit */
+static str_t tracer_append_extends(tracer_t *t, str_t s) {
     static char buf[128] = {0};
 
+    // promoted stack slots only hold for the sp on the region's own paths
+    if (t->ir->nextends == 0 || t->ir->nslots > 0) return s;
+
+    s = str_append(s, "    switch (target) {\n");
+    for (u64 k = 0; k < t->ir->nextends; k++) {
+        sprintf(buf, "    case %luULL: goto insn_%lx;\n", t->ir->extends[k],
+                t->ir->extends[k]);
+        s = str_append(s, buf);
+    }
+    s = str_append(s, "    }\n");
+    return s;
+}
+
+/* store back the registers and stack slots an exit may have dirtied */
+static str_t tracer_append_spill(tracer_t *t, str_t s, u64 dirty) {
+    static char buf[128] = {0};
+
+    dirty &= ~PINNED_REGS;
     for (int i = 1; i < num_gp_regs; i++) {
-        if (!t->gp_reg[i]) continue;
+        if (!(dirty & GP_REG(i))) continue;
         sprintf(buf, "    state->gp_regs[%d] = x%d;\n", i, i);
         s = str_append(s, buf);
     }
 
     for (int i = 0; i < num_fp_regs; i++) {
-        if (!t->fp_reg[i]) continue;
+        if (!(dirty & FP_REG(i))) continue;
         sprintf(buf, "    state->fp_regs[%d] = f%d;\n", i, i);
         s = str_append(s, buf);
     }
 
+    for (u64 k = 0; k < t->ir->nslots; k++) {
+        if (!(t->ir->slots_stored & (1U << k))) continue;
+        sprintf(buf,
+                "    *(uint64_t *)TO_HOST(frame + (int64_t)%ldLL) = "
+                "slot%lu;\n",
+                t->ir->slots[k], k);
+        s = str_append(s, buf);
+    }
+
+    return str_append(s, "    goto end;\n");
+}
+
+/*
+ * every exit stores back only the registers dirtied on the way to it, a
+ * charged node interrupted before it runs only those dirtied before it
+ */
+static str_t tracer_append_epilogue(tracer_t *t, str_t s) {
+    static char buf[128] = {0};
+
+    for (u64 n = 0; n < t->ir->ninsns; n++) {
+        ir_insn_t *node = &t->ir->insns[n];
+        if (node->exit) {
+            sprintf(buf, "exit_%lu:\n", n);
+            s = str_append(s, buf);
+            s = tracer_append_spill(t, s, node->dirty | node->def);
+        }
+        if (node->charge != 0 && node->op != IR_EXIT) {
+            sprintf(buf,
+                    "interrupt_%lu:\n"
+                    "    state->exit_reason = INTERRUPT;\n"
+                    "    state->reenter_pc = %luULL;\n"
+                    "    next = 0;\n",
+                    n, node->pc);
+            s = str_append(s, buf);
+            s = tracer_append_spill(t, s, node->dirty);
+        }
+    }
+
     return s;
 }
 
 static char funcbuf[128] = {0};
 static char funcbuf2[128] = {0};
+static u64 constval;
 
-#define REG_SET_VAL(reg, val)                                 \
-    if ((reg) != 0) {                                         \
-        sprintf(funcbuf, "    x%d = %ldLL;\n", (reg), (val)); \
-        s = str_append(s, funcbuf);                           \
+#define REG_SET_VAL(reg, val)                                       \
+    if ((reg) != 0) {                                               \
+        tracer_write(tracer, GP_REG(reg));                          \
+        sprintf(funcbuf, "    x%d = %luULL;\n", (reg), (u64)(val)); \
+        s = str_append(s, funcbuf);                                 \
     }
 
 #define REG_SET_EXPR(reg, expr)                             \
     if ((reg) != 0) {                                       \
+        tracer_write(tracer, GP_REG(reg));                  \
         sprintf(funcbuf, "    x%d = %s;\n", (reg), (expr)); \
         s = str_append(s, funcbuf);                         \
     }
 
 #define REG_GET(reg, name)                                          \
-    if ((reg) == zero) {                                            \
-        s = str_append(s, "    uint64_t " #name " = 0;\n");         \
+    if (ir_const(tracer_node(tracer), (reg), &constval)) {          \
+        sprintf(funcbuf, "    uint64_t " #name " = %luULL;\n",      \
+                constval);                                          \
+        s = str_append(s, funcbuf);                                 \
     } else {                                                        \
+        tracer_read(tracer, GP_REG(reg));                           \
         sprintf(funcbuf, "    uint64_t " #name " = x%d;\n", (reg)); \
         s = str_append(s, funcbuf);                                 \
     }
 
 #define FREG_SET_EXPR(reg, expr, field)                            \
+    tracer_write(tracer, FP_REG(reg));                             \
     sprintf(funcbuf, "    f%d." #field " = %s;\n", (reg), (expr)); \
     s = str_append(s, funcbuf);
 
 #define FREG_GET(reg, name, typ, field)                                    \
+    tracer_read(tracer, FP_REG(reg));                                      \
     sprintf(funcbuf, "    " #typ " " #name " = f%d." #field ";\n", (reg)); \
     s = str_append(s, funcbuf);
 
@@ -97,309 +348,318 @@ static char funcbuf2[128] = {0};
             (addr), (typ));                                              \
     s = str_append(s, funcbuf);
 
-static str_t func_empty(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+// a hint only, so an address past the guest memory does no harm
+#define MEM_PREFETCH(addr)                                  \
+    if (tracer_node(tracer)->prefetch != 0) {               \
+        sprintf(funcbuf,                                    \
+                "    __builtin_prefetch("                   \
+                "(void *)TO_HOST(%s + (int64_t)%ldLL));\n", \
+                (addr), tracer_node(tracer)->prefetch);     \
+        s = str_append(s, funcbuf);                         \
+    }
+
+// promoted stack slots live in host locals named after their index
+#define SLOT_LOAD(name)                                    \
+    sprintf(funcbuf, "    uint64_t " #name " = slot%d;\n", \
+            tracer_node(tracer)->slot - 1);                \
+    s = str_append(s, funcbuf);
+
+#define SLOT_STORE(data)                          \
+    sprintf(funcbuf, "    slot%d = " #data ";\n", \
+            tracer_node(tracer)->slot - 1);       \
+    s = str_append(s, funcbuf);
+
+static str_t func_empty(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     return s;
 }
 
-#define FUNC(typ)                                              \
-    REG_GET(insn->rs1, rs1);                                   \
-    sprintf(funcbuf2, "rs1 + (int64_t)%ldLL", (i64)insn->imm); \
-    MEM_LOAD(funcbuf2, typ, rd);                               \
-    REG_SET_EXPR(insn->rd, "rd");                              \
-    tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rd, -1);  \
+#define FUNC(typ)                                                  \
+    if (tracer_node(tracer)->slot) {                               \
+        SLOT_LOAD(rd);                                             \
+    } else {                                                       \
+        REG_GET(insn->rs1, rs1);                                   \
+        sprintf(funcbuf2, "rs1 + (int64_t)%ldLL", (i64)insn->imm); \
+        MEM_PREFETCH(funcbuf2);                                    \
+        MEM_LOAD(funcbuf2, typ, rd);                               \
+    }                                                              \
+    REG_SET_EXPR(insn->rd, "rd");                                  \
     return s;
 
-static str_t func_lb(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                     u64 pc) {
+static str_t func_lb(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("int8_t");
 }
 
-static str_t func_lh(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                     u64 pc) {
+static str_t func_lh(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("int16_t");
 }
 
-static str_t func_lw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                     u64 pc) {
+static str_t func_lw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("int32_t");
 }
 
-static str_t func_ld(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                     u64 pc) {
+static str_t func_ld(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("int64_t");
 }
 
-static str_t func_lbu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_lbu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint8_t");
 }
 
-static str_t func_lhu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_lhu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint16_t");
 }
 
-static str_t func_lwu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_lwu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint32_t");
 }
 
 #undef FUNC
 
-#define FUNC(stmt)                                            \
-    REG_GET(insn->rs1, rs1);                                  \
-    stmt;                                                     \
-    REG_SET_EXPR(insn->rd, funcbuf2);                         \
-    tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rd, -1); \
+#define FUNC(stmt)                    \
+    REG_GET(insn->rs1, rs1);          \
+    stmt;                             \
+    REG_SET_EXPR(insn->rd, funcbuf2); \
     return s;
 
-static str_t func_addi(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_addi(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "rs1 + (int64_t)%ldLL", (i64)insn->imm)));
 }
 
-static str_t func_slli(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_slli(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "rs1 << %d", insn->imm & 0x3f)));
 }
 
-static str_t func_slti(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_slti(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "(int64_t)rs1 < (int64_t)%ldLL ? 1 : 0",
                   (i64)insn->imm)));
 }
 
-static str_t func_sltiu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_sltiu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "rs1 < %luULL ? 1 : 0", (i64)insn->imm)))
 }
 
-static str_t func_xori(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_xori(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "rs1 ^ %ldLL", (i64)insn->imm)));
 }
 
-static str_t func_srli(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_srli(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "rs1 >> %d", insn->imm & 0x3f)));
 }
 
-static str_t func_srai(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_srai(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "(int64_t)rs1 >> %d", insn->imm & 0x3f)));
 }
 
-static str_t func_ori(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_ori(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "rs1 | %luULL", (i64)insn->imm)));
 }
 
-static str_t func_andi(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_andi(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "rs1 & %luULL", (i64)insn->imm)));
 }
 
-static str_t func_addiw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_addiw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "(int64_t)(int32_t)(rs1 + (int64_t)%ldLL)",
                   (i64)insn->imm)));
 }
 
-static str_t func_slliw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_slliw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC(
         (sprintf(funcbuf2, "(int64_t)(int32_t)(rs1 << %d)", insn->imm & 0x1f)));
 }
 
-static str_t func_srliw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_srliw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "(int64_t)(int32_t)((uint32_t)rs1 >> %d)",
                   insn->imm & 0x1f)));
 }
 
-static str_t func_sraiw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_sraiw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC(
         (sprintf(funcbuf2, "(int64_t)((int32_t)rs1 >> %d)", insn->imm & 0x1f)));
 }
 
 #undef FUNC
 
-static str_t func_auipc(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_auipc(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     u64 val = pc + (i64)insn->imm;
     REG_SET_VAL(insn->rd, val);
 
-    tracer_add_gp_reg_usage(tracer, insn->rd, -1);
     return s;
 }
 
-#define FUNC(typ)                                              \
-    REG_GET(insn->rs1, rs1);                                   \
-    REG_GET(insn->rs2, rs2);                                   \
-    sprintf(funcbuf2, "rs1 + (int64_t)%ldLL", (i64)insn->imm); \
-    MEM_STORE(funcbuf2, typ, rs2);                             \
-    tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rs2, -1); \
+#define FUNC(typ)                                                  \
+    REG_GET(insn->rs2, rs2);                                       \
+    if (tracer_node(tracer)->slot) {                               \
+        SLOT_STORE(rs2);                                           \
+    } else {                                                       \
+        REG_GET(insn->rs1, rs1);                                   \
+        sprintf(funcbuf2, "rs1 + (int64_t)%ldLL", (i64)insn->imm); \
+        MEM_STORE(funcbuf2, typ, rs2);                             \
+    }                                                              \
     return s;
 
-static str_t func_sb(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                     u64 pc) {
+static str_t func_sb(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint8_t");
 }
 
-static str_t func_sh(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                     u64 pc) {
+static str_t func_sh(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint16_t");
 }
 
-static str_t func_sw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                     u64 pc) {
+static str_t func_sw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint32_t");
 }
 
-static str_t func_sd(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                     u64 pc) {
+static str_t func_sd(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint64_t");
 }
 
 #undef FUNC
 
-#define FUNC(expr)                                                       \
-    REG_GET(insn->rs1, rs1);                                             \
-    REG_GET(insn->rs2, rs2);                                             \
-    REG_SET_EXPR(insn->rd, expr);                                        \
-    tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1); \
+#if JIT_TRAP_DIV
+/* divide with the bare host instruction, x / 0 and INT_MIN / -1 fault and
+ * the SIGFPE handler writes the RISC-V quotient and remainder into q and r */
+static str_t gen_trap_div(str_t s, insn_t *insn, tracer_t *tracer,
+                          const char *op, const char *typ, const char *res) {
+    REG_GET(insn->rs1, rs1);
+    REG_GET(insn->rs2, rs2);
+    sprintf(funcbuf, "    %s q, r;\n    __asm__(\"%s\"", typ, op);
+    s = str_append(s, funcbuf);
+    sprintf(funcbuf,
+            " : \"=a\"(q), \"=&d\"(r) : \"r\"((%s)rs2), \"0\"((%s)rs1));\n",
+            typ, typ);
+    s = str_append(s, funcbuf);
+    REG_SET_EXPR(insn->rd, res);
+    return s;
+}
+
+// a constant divisor keeps the checked division, clang folds it away
+#define TRAP_DIV(op, typ, res)                                  \
+    if (!ir_const(tracer_node(tracer), insn->rs2, &constval)) { \
+        return gen_trap_div(s, insn, tracer, op, typ, res);     \
+    }
+#else
+#define TRAP_DIV(op, typ, res)
+#endif
+
+#define FUNC(expr)                \
+    REG_GET(insn->rs1, rs1);      \
+    REG_GET(insn->rs2, rs2);      \
+    REG_SET_EXPR(insn->rd, expr); \
     return s;
 
-static str_t func_add(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_add(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 + rs2");
 }
 
-static str_t func_sll(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_sll(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 << (rs2 & 0x3f)");
 }
 
-static str_t func_slt(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_slt(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("((int64_t)rs1 < (int64_t)rs2) ? 1 : 0");
 }
 
-static str_t func_sltu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_sltu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("((uint64_t)rs1 < (uint64_t)rs2) ? 1 : 0");
 }
 
-static str_t func_xor(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_xor(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 ^ rs2");
 }
 
-static str_t func_srl(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_srl(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 >> (rs2 & 0x3f)");
 }
 
-static str_t func_or(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                     u64 pc) {
+static str_t func_or(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 | rs2");
 }
 
-static str_t func_and(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_and(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 & rs2");
 }
 
-static str_t func_mul(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_mul(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 * rs2");
 }
 
-static str_t func_sub(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_sub(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC(("rs1 - rs2"));
 }
 
-static str_t func_sra(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_sra(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC(("(int64_t)rs1 >> (rs2 & 0x3f)"));
 }
 
-static str_t func_remu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_remu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    TRAP_DIV("xorl %%edx, %%edx\\n\\tdivq %2", "uint64_t", "r");
     FUNC("(rs2 == 0 ? rs1 : rs1 % rs2)");
 }
 
-static str_t func_addw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_addw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(int64_t)(int32_t)(rs1 + rs2)");
 }
 
-static str_t func_sllw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_sllw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(int64_t)(int32_t)(rs1 << (rs2 & 0x1f))");
 }
 
-static str_t func_srlw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_srlw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(int64_t)(int32_t)((uint32_t)rs1 >> (rs2 & 0x1f))");
 }
 
-static str_t func_mulw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_mulw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(int64_t)(int32_t)(rs1 * rs2)");
 }
 
-static str_t func_divw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_divw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    TRAP_DIV("cltd\\n\\tidivl %2", "int32_t", "(int64_t)(int32_t)q");
     FUNC(
         "(rs2 == 0 ? UINT64_MAX : (int32_t)((int64_t)(int32_t)rs1 / "
         "(int64_t)(int32_t)rs2))");
 }
 
-static str_t func_divuw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_divuw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    TRAP_DIV("xorl %%edx, %%edx\\n\\tdivl %2", "uint32_t",
+             "(int64_t)(int32_t)q");
     FUNC("(rs2 == 0 ? UINT64_MAX : (int32_t)((uint32_t)rs1 / (uint32_t)rs2))");
 }
 
-static str_t func_remw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_remw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    TRAP_DIV("cltd\\n\\tidivl %2", "int32_t", "(int64_t)(int32_t)r");
     FUNC(
         "(rs2 == 0 ? (int64_t)(int32_t)rs1 : "
         "(int64_t)(int32_t)((int64_t)(int32_t)rs1 % (int64_t)(int32_t)rs2))");
 }
 
-static str_t func_remuw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_remuw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    TRAP_DIV("xorl %%edx, %%edx\\n\\tdivl %2", "uint32_t",
+             "(int64_t)(int32_t)r");
     FUNC(
         "(rs2 == 0 ? (int64_t)(int32_t)(uint32_t)rs1 : "
         "(int64_t)(int32_t)((uint32_t)rs1 % (uint32_t)rs2))");
 }
 
-static str_t func_subw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_subw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(int64_t)(int32_t)(rs1 - rs2)");
 }
 
-static str_t func_sraw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_sraw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(int64_t)(int32_t)((int32_t)rs1 >> (rs2 & 0x1f))");
 }
 
 #undef FUNC
 
-#define FUNC(stmt)                                                       \
-    REG_GET(insn->rs1, rs1);                                             \
-    REG_GET(insn->rs2, rs2);                                             \
-    stmt;                                                                \
-    REG_SET_EXPR(insn->rd, "rd");                                        \
-    tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1); \
+#define FUNC(stmt)                \
+    REG_GET(insn->rs1, rs1);      \
+    REG_GET(insn->rs2, rs2);      \
+    stmt;                         \
+    REG_SET_EXPR(insn->rd, "rd"); \
     return s;
 
-static str_t func_div(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_div(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    TRAP_DIV("cqo\\n\\tidivq %2", "int64_t", "q");
     FUNC((s = str_append(
               s,
               "    uint64_t rd = 0;                                   \n"
@@ -412,8 +672,8 @@ static str_t func_div(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
               "    }                                                  \n")));
 }
 
-static str_t func_divu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_divu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    TRAP_DIV("xorl %%edx, %%edx\\n\\tdivq %2", "uint64_t", "q");
     FUNC((s = str_append(s,
                          "    uint64_t rd = 0;    \n"
                          "    if (rs2 == 0) {     \n"
@@ -423,8 +683,8 @@ static str_t func_divu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
                          "    }                   \n")));
 }
 
-static str_t func_rem(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_rem(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    TRAP_DIV("cqo\\n\\tidivq %2", "int64_t", "r");
     FUNC((s = str_append(
               s,
               "    uint64_t rd = 0;                                   \n"
@@ -439,621 +699,603 @@ static str_t func_rem(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
 
 #undef FUNC
 
-static str_t func_lui(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
-    tracer_add_gp_reg_usage(tracer, insn->rd, -1);
+/* a register write folded into a constant */
+static str_t func_li(str_t s, insn_t *insn, tracer_t *tracer, u64 val) {
+    REG_SET_VAL(insn->rd, (i64)val);
+    return s;
+}
+
+static str_t func_lui(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_SET_VAL(insn->rd, (i64)insn->imm);
     return s;
 }
 
-#define FUNC(typ, op)                                                  \
-    REG_GET(insn->rs1, rs1);                                           \
-    REG_GET(insn->rs2, rs2);                                           \
-    u64 target_addr = pc + (i64)insn->imm;                             \
-    sprintf(funcbuf, "    if ((%s)rs1 %s (%s)rs2) {\n", typ, op, typ); \
-    s = str_append(s, funcbuf);                                        \
-    sprintf(funcbuf, "        goto insn_%lx;\n", target_addr);         \
-    s = str_append(s, funcbuf);                                        \
-    s = str_append(s, "    }\n");                                      \
-    stack_push(stack, target_addr);                                    \
-    tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rs2, -1);         \
+#define FUNC(typ, op)                                              \
+    REG_GET(insn->rs1, rs1);                                       \
+    REG_GET(insn->rs2, rs2);                                       \
+    u64 target_addr = pc + (i64)insn->imm;                         \
+    i8 likely = tracer_node(tracer)->likely;                       \
+    sprintf(funcbuf2, "(%s)rs1 %s (%s)rs2", typ, op, typ);         \
+    if (likely != 0)                                               \
+        sprintf(funcbuf, "    if (__builtin_expect(%s, %d)) {\n",  \
+                funcbuf2, likely > 0);                             \
+    else                                                           \
+        sprintf(funcbuf, "    if (%s) {\n", funcbuf2);             \
+    s = str_append(s, funcbuf);                                    \
+    if (target_addr == tracer->loop_pc) {                          \
+        s = str_append(s, "        continue;\n");                  \
+    } else {                                                       \
+        sprintf(funcbuf, "        goto insn_%lx;\n", target_addr); \
+        s = str_append(s, funcbuf);                                \
+    }                                                              \
+    s = str_append(s, "    }\n");                                  \
     return s;
 
-static str_t func_beq(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_beq(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint64_t", "==");
 }
 
-static str_t func_bne(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_bne(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint64_t", "!=");
 }
 
-static str_t func_blt(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_blt(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("int64_t", "<");
 }
 
-static str_t func_bge(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_bge(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("int64_t", ">=");
 }
 
-static str_t func_bltu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_bltu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint64_t", "<");
 }
 
-static str_t func_bgeu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+static str_t func_bgeu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint64_t", ">=");
 }
 
 #undef FUNC
 
-static str_t func_jalr(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
+// a call pushes its return address onto the shadow return address stack
+#define RAS_PUSH(return_addr)                                              \
+    if (insn->rd == ra) {                                                  \
+        u64 link = tracer_add_link(tracer, (return_addr));                 \
+        s = str_append(s, "    ras = &state->ras[++state->ras_top & ");    \
+        sprintf(funcbuf, "%d];\n    ras->pc = %luULL;\n", RAS_SIZE - 1,    \
+                (return_addr));                                            \
+        s = str_append(s, funcbuf);                                        \
+        sprintf(funcbuf, "    ras->link = (void **)&links[%lu];\n", link); \
+        s = str_append(s, funcbuf);                                        \
+    }
+
+static str_t func_jalr(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     u64 return_addr = pc + (insn->rvc ? 2 : 4);
     REG_GET(insn->rs1, rs1);
     REG_SET_VAL(insn->rd, return_addr);
+    RAS_PUSH(return_addr);
 
-    s = str_append(s, "    state->exit_reason = INDIRECT_JMP;\n");
-    sprintf(funcbuf,
-            "    state->reenter_pc = (rs1 + (int64_t)%ldLL) & ~(uint64_t)1;\n",
+    sprintf(funcbuf, "    target = (rs1 + (int64_t)%ldLL) & ~(uint64_t)1;\n",
             (i64)insn->imm);
     s = str_append(s, funcbuf);
-    s = str_append(s, "    goto end;\n");
+    if (tracer_node(tracer)->to_ret) {
+        s = str_append(s, "    goto ret;\n");
+    } else {
+        u64 guard = tracer_node(tracer)->guard;
+        if (guard != 0) {
+            sprintf(funcbuf, "    if (target == %luULL) goto insn_%lx;\n",
+                    guard, guard);
+            s = str_append(s, funcbuf);
+        }
+        s = str_append(s, "    goto indirect;\n");
+    }
     s = str_append(s, "}\n");
-    tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rd, -1);
     return s;
 }
 
-static str_t func_jal(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_jal(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     u64 return_addr = pc + (insn->rvc ? 2 : 4);
     u64 target_addr = pc + (i64)insn->imm;
 
     REG_SET_VAL(insn->rd, return_addr);
+    RAS_PUSH(return_addr);
+    sprintf(funcbuf, "    goto insn_%lx;\n", target_addr);
+    s = str_append(s, funcbuf);
+    s = str_append(s, "}\n");
+
+    return s;
+}
+
+/* auipc+jalr (long call or tail call) has a known target, like jal */
+static str_t func_auipc_jalr(str_t s, insn_t *auipc, insn_t *insn,
+                             tracer_t *tracer, u64 pc) {
+    u64 return_addr = pc + 4 + (insn->rvc ? 2 : 4);
+    u64 target_addr = (pc + (i64)auipc->imm + (i64)insn->imm) & ~(u64)1;
+
+    REG_SET_VAL(auipc->rd, pc + (i64)auipc->imm);
+    REG_SET_VAL(insn->rd, return_addr);
+    RAS_PUSH(return_addr);
     sprintf(funcbuf, "    goto insn_%lx;\n", target_addr);
     s = str_append(s, funcbuf);
-    stack_push(stack, target_addr);
     s = str_append(s, "}\n");
 
-    tracer_add_gp_reg_usage(tracer, insn->rd, -1);
     return s;
 }
 
-static str_t func_ecall(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_ecall(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     s = str_append(s, "    state->exit_reason = ecall;\n");
     sprintf(funcbuf, "    state->reenter_pc = %luULL;\n", pc + 4);
     s = str_append(s, funcbuf);
-    s = str_append(s, "    goto end;\n");
+    sprintf(funcbuf, "    goto exit_%lu;\n", tracer->cur);
+    s = str_append(s, funcbuf);
     s = str_append(s, "}\n");
     return s;
 }
 
-#define FUNC()                                         \
-    switch (insn->csr) {                               \
-        case fflags:                                   \
-        case frm:                                      \
-        case fcsr:                                     \
-            break;                                     \
-        default:                                       \
-            Fatal("unsupported csr");                  \
-    }                                                  \
-    if (insn->rd) {                                    \
-        sprintf(funcbuf, "    x%d = 0;\n", insn->rd);  \
-        tracer_add_gp_reg_usage(tracer, insn->rd, -1); \
-        s = str_append(s, funcbuf);                    \
-    }                                                  \
+#define FUNC()                        \
+    switch (insn->csr) {              \
+        case fflags:                  \
+        case frm:                     \
+        case fcsr:                    \
+            break;                    \
+        default:                      \
+            Fatal("unsupported csr"); \
+    }                                 \
+    REG_SET_VAL(insn->rd, 0L);        \
     return s;
 
-static str_t func_csrrw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_csrrw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC();
 }
 
-static str_t func_csrrs(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_csrrs(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC();
 }
 
-static str_t func_csrrc(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_csrrc(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC();
 }
 
-static str_t func_csrrwi(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
+static str_t func_csrrwi(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC();
 }
 
-static str_t func_csrrsi(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
+static str_t func_csrrsi(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC();
 }
 
-static str_t func_csrrci(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
+static str_t func_csrrci(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC();
 }
 
 #undef FUNC
 
-#define FUNC(typ, expr)                                        \
-    REG_GET(insn->rs1, rs1);                                   \
-    sprintf(funcbuf2, "rs1 + (int64_t)%ldLL", (i64)insn->imm); \
-    MEM_LOAD(funcbuf2, typ, rd);                               \
-    FREG_SET_EXPR(insn->rd, expr, v);                          \
-    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);            \
-    tracer_add_fp_reg_usage(tracer, insn->rd, -1);             \
+#define FUNC(typ, expr)                                            \
+    if (tracer_node(tracer)->slot) {                               \
+        SLOT_LOAD(rd);                                             \
+    } else {                                                       \
+        REG_GET(insn->rs1, rs1);                                   \
+        sprintf(funcbuf2, "rs1 + (int64_t)%ldLL", (i64)insn->imm); \
+        MEM_PREFETCH(funcbuf2);                                    \
+        MEM_LOAD(funcbuf2, typ, rd);                               \
+    }                                                              \
+    FREG_SET_EXPR(insn->rd, expr, v);                              \
     return s;
 
-static str_t func_flw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_flw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint32_t", "rd | ((uint64_t)-1 << 32)");
 }
 
-static str_t func_fld(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_fld(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint64_t", "rd");
 }
 
 #undef FUNC
 
-#define FUNC(typ)                                              \
-    REG_GET(insn->rs1, rs1);                                   \
-    FREG_GET(insn->rs2, rs2, uint64_t, v);                     \
-    sprintf(funcbuf2, "rs1 + (int64_t)%ldLL", (i64)insn->imm); \
-    MEM_STORE(funcbuf2, typ, rs2);                             \
-    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);            \
-    tracer_add_fp_reg_usage(tracer, insn->rs2, -1);            \
+#define FUNC(typ)                                                  \
+    FREG_GET(insn->rs2, rs2, uint64_t, v);                         \
+    if (tracer_node(tracer)->slot) {                               \
+        SLOT_STORE(rs2);                                           \
+    } else {                                                       \
+        REG_GET(insn->rs1, rs1);                                   \
+        sprintf(funcbuf2, "rs1 + (int64_t)%ldLL", (i64)insn->imm); \
+        MEM_STORE(funcbuf2, typ, rs2);                             \
+    }                                                              \
     return s;
 
-static str_t func_fsw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_fsw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint32_t");
 }
 
-static str_t func_fsd(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                      u64 pc) {
+static str_t func_fsd(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint64_t");
 }
 
 #undef FUNC
 
-#define FUNC(expr)                                                             \
-    FREG_GET(insn->rs1, rs1, float, f);                                        \
-    FREG_GET(insn->rs2, rs2, float, f);                                        \
-    FREG_GET(insn->rs3, rs3, float, f);                                        \
-    FREG_SET_EXPR(insn->rd, expr, f);                                          \
-    tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rs3, insn->rd, \
-                            -1);                                               \
+/* fused multiply-add rounds once, lower it to the host FMA when there is one */
+static bool host_has_fma(void) {
+#if defined(__x86_64__)
+    return __builtin_cpu_supports("fma");
+#else
+    return true;
+#endif
+}
+
+static const char *gen_fma(bool dbl) {
+    static char buf[64];
+    if (host_has_fma()) return dbl ? "__builtin_fma" : "__builtin_fmaf";
+    if (dbl)
+        sprintf(buf, "((double (*)(double, double, double))%luULL)",
+                (u64)fma);
+    else
+        sprintf(buf, "((float (*)(float, float, float))%luULL)", (u64)fmaf);
+    return buf;
+}
+
+#define FUNC(neg1, neg3)                                                \
+    char expr[96];                                                      \
+    FREG_GET(insn->rs1, rs1, float, f);                                 \
+    FREG_GET(insn->rs2, rs2, float, f);                                 \
+    FREG_GET(insn->rs3, rs3, float, f);                                 \
+    sprintf(expr, "%s(" neg1 "rs1, rs2, " neg3 "rs3)", gen_fma(false)); \
+    FREG_SET_EXPR(insn->rd, expr, f);                                   \
     return s;
 
-static str_t func_fmadd_s(str_t s, insn_t *insn, tracer_t *tracer,
-                          stack_t *stack, u64 pc) {
-    FUNC("rs1 * rs2 + rs3");
+static str_t func_fmadd_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("", "");
 }
 
-static str_t func_fmsub_s(str_t s, insn_t *insn, tracer_t *tracer,
-                          stack_t *stack, u64 pc) {
-    FUNC("rs1 * rs2 - rs3");
+static str_t func_fmsub_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("", "-");
 }
 
-static str_t func_fnmsub_s(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
-    FUNC("-(rs1 * rs2) + rs3");
+static str_t func_fnmsub_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("-", "");
 }
 
-static str_t func_fnmadd_s(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
-    FUNC("-(rs1 * rs2) - rs3");
+static str_t func_fnmadd_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("-", "-");
 }
 
 #undef FUNC
 
-#define FUNC(expr)                                                             \
-    FREG_GET(insn->rs1, rs1, double, d);                                       \
-    FREG_GET(insn->rs2, rs2, double, d);                                       \
-    FREG_GET(insn->rs3, rs3, double, d);                                       \
-    FREG_SET_EXPR(insn->rd, expr, d);                                          \
-    tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rs3, insn->rd, \
-                            -1);                                               \
+#define FUNC(neg1, neg3)                                               \
+    char expr[96];                                                     \
+    FREG_GET(insn->rs1, rs1, double, d);                               \
+    FREG_GET(insn->rs2, rs2, double, d);                               \
+    FREG_GET(insn->rs3, rs3, double, d);                               \
+    sprintf(expr, "%s(" neg1 "rs1, rs2, " neg3 "rs3)", gen_fma(true)); \
+    FREG_SET_EXPR(insn->rd, expr, d);                                  \
     return s;
 
-static str_t func_fmadd_d(str_t s, insn_t *insn, tracer_t *tracer,
-                          stack_t *stack, u64 pc) {
-    FUNC("rs1 * rs2 + rs3");
+static str_t func_fmadd_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("", "");
 }
 
-static str_t func_fmsub_d(str_t s, insn_t *insn, tracer_t *tracer,
-                          stack_t *stack, u64 pc) {
-    FUNC("rs1 * rs2 - rs3");
+static str_t func_fmsub_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("", "-");
 }
 
-static str_t func_fnmsub_d(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
-    FUNC("-(rs1 * rs2) + rs3");
+static str_t func_fnmsub_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("-", "");
 }
 
-static str_t func_fnmadd_d(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
-    FUNC("-(rs1 * rs2) - rs3");
+static str_t func_fnmadd_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("-", "-");
 }
 
 #undef FUNC
 
-#define FUNC(expr)                                                       \
-    FREG_GET(insn->rs1, rs1, float, f);                                  \
-    FREG_GET(insn->rs2, rs2, float, f);                                  \
-    FREG_SET_EXPR(insn->rd, expr, f);                                    \
-    tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1); \
+#define FUNC(expr)                      \
+    FREG_GET(insn->rs1, rs1, float, f); \
+    FREG_GET(insn->rs2, rs2, float, f); \
+    FREG_SET_EXPR(insn->rd, expr, f);   \
     return s;
 
-static str_t func_fadd_s(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
+static str_t func_fadd_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 + rs2");
 }
 
-static str_t func_fsub_s(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
+static str_t func_fsub_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 - rs2");
 }
 
-static str_t func_fmul_s(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
+static str_t func_fmul_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 * rs2");
 }
 
-static str_t func_fdiv_s(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
+static str_t func_fdiv_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 / rs2");
 }
 
-static str_t func_fmin_s(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
+static str_t func_fmin_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 < rs2 ? rs1 : rs2");
 }
 
-static str_t func_fmax_s(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
+static str_t func_fmax_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 > rs2 ? rs1 : rs2");
 }
 
 #undef FUNC
 
-static str_t func_fcvt_s_w(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
+static str_t func_fcvt_s_w(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(float)(int32_t)rs1", f);
-    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
-    tracer_add_fp_reg_usage(tracer, insn->rd, -1);
     return s;
 }
 
-static str_t func_fcvt_s_wu(str_t s, insn_t *insn, tracer_t *tracer,
-                            stack_t *stack, u64 pc) {
+static str_t func_fcvt_s_wu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(float)(uint32_t)rs1", f);
-    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
-    tracer_add_fp_reg_usage(tracer, insn->rd, -1);
     return s;
 }
 
-static str_t func_fcvt_d_w(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
+static str_t func_fcvt_d_w(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(double)(int32_t)rs1", d);
-    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
-    tracer_add_fp_reg_usage(tracer, insn->rd, -1);
     return s;
 }
 
-static str_t func_fcvt_d_wu(str_t s, insn_t *insn, tracer_t *tracer,
-                            stack_t *stack, u64 pc) {
+static str_t func_fcvt_d_wu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(double)(uint32_t)rs1", d);
-    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
-    tracer_add_fp_reg_usage(tracer, insn->rd, -1);
     return s;
 }
 
-static str_t func_fmv_x_w(str_t s, insn_t *insn, tracer_t *tracer,
-                          stack_t *stack, u64 pc) {
+static str_t func_fmv_x_w(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FREG_GET(insn->rs1, rs1, uint32_t, w);
     REG_SET_EXPR(insn->rd, "(int64_t)(int32_t)rs1");
-    tracer_add_gp_reg_usage(tracer, insn->rd, -1);
-    tracer_add_fp_reg_usage(tracer, insn->rs1, -1);
     return s;
 }
 
-static str_t func_fmv_w_x(str_t s, insn_t *insn, tracer_t *tracer,
-                          stack_t *stack, u64 pc) {
+static str_t func_fmv_w_x(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(uint32_t)rs1", w);
-    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
-    tracer_add_fp_reg_usage(tracer, insn->rd, -1);
     return s;
 }
 
-static str_t func_fmv_x_d(str_t s, insn_t *insn, tracer_t *tracer,
-                          stack_t *stack, u64 pc) {
+static str_t func_fmv_x_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FREG_GET(insn->rs1, rs1, uint64_t, v);
     REG_SET_EXPR(insn->rd, "rs1");
-    tracer_add_gp_reg_usage(tracer, insn->rd, -1);
-    tracer_add_fp_reg_usage(tracer, insn->rs1, -1);
     return s;
 }
 
-static str_t func_fmv_d_x(str_t s, insn_t *insn, tracer_t *tracer,
-                          stack_t *stack, u64 pc) {
+static str_t func_fmv_d_x(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "rs1", v);
-    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
-    tracer_add_fp_reg_usage(tracer, insn->rd, -1);
     return s;
 }
 
-#define FUNC(expr)                                             \
-    FREG_GET(insn->rs1, rs1, float, f);                        \
-    FREG_GET(insn->rs2, rs2, float, f);                        \
-    REG_SET_EXPR(insn->rd, expr);                              \
-    tracer_add_gp_reg_usage(tracer, insn->rd, -1);             \
-    tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, -1); \
+#define FUNC(expr)                      \
+    FREG_GET(insn->rs1, rs1, float, f); \
+    FREG_GET(insn->rs2, rs2, float, f); \
+    REG_SET_EXPR(insn->rd, expr);       \
     return s;
 
-static str_t func_feq_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_feq_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 == rs2");
 }
 
-static str_t func_flt_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_flt_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 < rs2");
 }
 
-static str_t func_fle_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_fle_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 <= rs2");
 }
 
 #undef FUNC
 
-#define FUNC(expr)                                             \
-    FREG_GET(insn->rs1, rs1, double, d);                       \
-    FREG_GET(insn->rs2, rs2, double, d);                       \
-    REG_SET_EXPR(insn->rd, expr);                              \
-    tracer_add_gp_reg_usage(tracer, insn->rd, -1);             \
-    tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, -1); \
+#define FUNC(expr)                       \
+    FREG_GET(insn->rs1, rs1, double, d); \
+    FREG_GET(insn->rs2, rs2, double, d); \
+    REG_SET_EXPR(insn->rd, expr);        \
     return s;
 
-static str_t func_feq_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_feq_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 == rs2");
 }
 
-static str_t func_flt_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_flt_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 < rs2");
 }
 
-static str_t func_fle_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
+static str_t func_fle_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 <= rs2");
 }
 
 #undef FUNC
 
-static str_t func_fcvt_s_l(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
+static str_t func_fcvt_s_l(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(float)(int64_t)rs1", f);
-    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
-    tracer_add_fp_reg_usage(tracer, insn->rd, -1);
     return s;
 }
 
-static str_t func_fcvt_s_lu(str_t s, insn_t *insn, tracer_t *tracer,
-                            stack_t *stack, u64 pc) {
+static str_t func_fcvt_s_lu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(float)(uint64_t)rs1", f);
-    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
-    tracer_add_fp_reg_usage(tracer, insn->rd, -1);
     return s;
 }
 
-#define FUNC(expr)                                                       \
-    FREG_GET(insn->rs1, rs1, double, d);                                 \
-    FREG_GET(insn->rs2, rs2, double, d);                                 \
-    FREG_SET_EXPR(insn->rd, expr, d);                                    \
-    tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1); \
+#define FUNC(expr)                       \
+    FREG_GET(insn->rs1, rs1, double, d); \
+    FREG_GET(insn->rs2, rs2, double, d); \
+    FREG_SET_EXPR(insn->rd, expr, d);    \
     return s;
 
-static str_t func_fadd_d(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
+static str_t func_fadd_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 + rs2");
 }
 
-static str_t func_fsub_d(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
+static str_t func_fsub_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 - rs2");
 }
 
-static str_t func_fmul_d(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
+static str_t func_fmul_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 * rs2");
 }
 
-static str_t func_fdiv_d(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
+static str_t func_fdiv_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 / rs2");
 }
 
-static str_t func_fmin_d(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
+static str_t func_fmin_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 < rs2 ? rs1 : rs2");
 }
 
-static str_t func_fmax_d(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
+static str_t func_fmax_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 > rs2 ? rs1 : rs2");
 }
 
 #undef FUNC
 
-static str_t func_fcvt_s_d(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
+static str_t func_fcvt_s_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FREG_GET(insn->rs1, rs1, double, d);
     FREG_SET_EXPR(insn->rd, "(float)rs1", f);
-    tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rd, -1);
     return s;
 }
 
-static str_t func_fcvt_d_s(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
+static str_t func_fcvt_d_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FREG_GET(insn->rs1, rs1, float, f);
     FREG_SET_EXPR(insn->rd, "(double)rs1", d);
-    tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rd, -1);
     return s;
 }
 
-static str_t func_fcvt_d_l(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
+static str_t func_fcvt_d_l(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(double)(int64_t)rs1", d);
-    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
-    tracer_add_fp_reg_usage(tracer, insn->rd, -1);
     return s;
 }
 
-static str_t func_fcvt_d_lu(str_t s, insn_t *insn, tracer_t *tracer,
-                            stack_t *stack, u64 pc) {
+static str_t func_fcvt_d_lu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(double)(uint64_t)rs1", d);
-    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
-    tracer_add_fp_reg_usage(tracer, insn->rd, -1);
     return s;
 }
 
-#define FUNC()                                                 \
-    s = str_append(s, "    state->exit_reason = INTERP;\n");   \
-    sprintf(funcbuf, "    state->reenter_pc = %luULL;\n", pc); \
-    s = str_append(s, funcbuf);                                \
-    s = str_append(s, "    goto end;\n");                      \
-    s = str_append(s, "}\n");                                  \
-    insn->continu = true;                                      \
+#define FUNC(expr)                \
+    REG_GET(insn->rs1, rs1);      \
+    REG_GET(insn->rs2, rs2);      \
+    REG_SET_EXPR(insn->rd, expr); \
     return s;
 
-static str_t func_mulh(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                       u64 pc) {
-    FUNC();
+static str_t func_mulh(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("(uint64_t)(((__int128)(int64_t)rs1 * (int64_t)rs2) >> 64)");
 }
 
-static str_t func_mulhsu(str_t s, insn_t *insn, tracer_t *tracer,
-                         stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_mulhsu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("(uint64_t)(((__int128)(int64_t)rs1 * (__int128)rs2) >> 64)");
 }
 
-static str_t func_mulhu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
-                        u64 pc) {
-    FUNC();
+static str_t func_mulhu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("(uint64_t)(((unsigned __int128)rs1 * rs2) >> 64)");
 }
 
-static str_t func_fsqrt_s(str_t s, insn_t *insn, tracer_t *tracer,
-                          stack_t *stack, u64 pc) {
-    FUNC();
+#undef FUNC
+
+static str_t func_fsqrt_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FREG_GET(insn->rs1, rs1, float, f);
+    FREG_SET_EXPR(insn->rd, "__builtin_sqrtf(rs1)", f);
+    return s;
 }
 
-static str_t func_fcvt_w_s(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fsqrt_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FREG_GET(insn->rs1, rs1, double, d);
+    FREG_SET_EXPR(insn->rd, "__builtin_sqrt(rs1)", d);
+    return s;
 }
 
-static str_t func_fcvt_wu_s(str_t s, insn_t *insn, tracer_t *tracer,
-                            stack_t *stack, u64 pc) {
-    FUNC();
+#define FUNC(typ, field, expr)            \
+    FREG_GET(insn->rs1, rs1, typ, field); \
+    REG_SET_EXPR(insn->rd, expr);         \
+    return s;
+
+static str_t func_fcvt_w_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(float, f, "(int64_t)(int32_t)__builtin_llrintf(rs1)");
 }
 
-static str_t func_fcvt_w_d(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fcvt_wu_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(float, f, "(int64_t)(int32_t)(uint32_t)__builtin_llrintf(rs1)");
 }
 
-static str_t func_fcvt_wu_d(str_t s, insn_t *insn, tracer_t *tracer,
-                            stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fcvt_w_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(double, d, "(int64_t)(int32_t)__builtin_llrint(rs1)");
 }
 
-static str_t func_fclass_s(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fcvt_wu_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(double, d, "(int64_t)(int32_t)(uint32_t)__builtin_llrint(rs1)");
 }
 
-static str_t func_fclass_d(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fclass_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(uint32_t, w, "fclass32(rs1)");
 }
 
-static str_t func_fcvt_l_s(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fclass_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(uint64_t, v, "fclass64(rs1)");
 }
 
-static str_t func_fcvt_lu_s(str_t s, insn_t *insn, tracer_t *tracer,
-                            stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fcvt_l_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(float, f, "(int64_t)__builtin_llrintf(rs1)");
 }
 
-static str_t func_fcvt_l_d(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fcvt_lu_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(float, f, "(uint64_t)__builtin_llrintf(rs1)");
 }
 
-static str_t func_fcvt_lu_d(str_t s, insn_t *insn, tracer_t *tracer,
-                            stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fcvt_l_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(double, d, "(int64_t)__builtin_llrint(rs1)");
 }
 
-static str_t func_fsgnj_s(str_t s, insn_t *insn, tracer_t *tracer,
-                          stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fcvt_lu_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(double, d, "(uint64_t)__builtin_llrint(rs1)");
 }
 
-static str_t func_fsgnjn_s(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
-    FUNC();
+#undef FUNC
+
+#define FUNC(expr)                                                         \
+    FREG_GET(insn->rs1, rs1, uint32_t, w);                                 \
+    FREG_GET(insn->rs2, rs2, uint32_t, w);                                 \
+    FREG_SET_EXPR(insn->rd, "(uint64_t)(" expr ") | ((uint64_t)-1 << 32)", \
+                  v);                                                      \
+    return s;
+
+static str_t func_fsgnj_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("(rs1 & 0x7fffffffU) | (rs2 & 0x80000000U)");
 }
 
-static str_t func_fsgnjx_s(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fsgnjn_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("(rs1 & 0x7fffffffU) | (~rs2 & 0x80000000U)");
 }
 
-static str_t func_fsgnj_d(str_t s, insn_t *insn, tracer_t *tracer,
-                          stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fsgnjx_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("rs1 ^ (rs2 & 0x80000000U)");
 }
 
-static str_t func_fsgnjn_d(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
-    FUNC();
+#undef FUNC
+
+#define FUNC(expr)                         \
+    FREG_GET(insn->rs1, rs1, uint64_t, v); \
+    FREG_GET(insn->rs2, rs2, uint64_t, v); \
+    FREG_SET_EXPR(insn->rd, expr, v);      \
+    return s;
+
+static str_t func_fsgnj_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("(rs1 & ~(1ULL << 63)) | (rs2 & (1ULL << 63))");
 }
 
-static str_t func_fsgnjx_d(str_t s, insn_t *insn, tracer_t *tracer,
-                           stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fsgnjn_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("(rs1 & ~(1ULL << 63)) | (~rs2 & (1ULL << 63))");
 }
 
-static str_t func_fsqrt_d(str_t s, insn_t *insn, tracer_t *tracer,
-                          stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fsgnjx_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("rs1 ^ (rs2 & (1ULL << 63))");
 }
 
 #undef FUNC
 
-typedef str_t(func_t)(str_t, insn_t *, tracer_t *, stack_t *, u64);
+typedef str_t(func_t)(str_t, insn_t *, tracer_t *, u64);
 
 static func_t *funcs[] = {
     func_lb,       func_lh,        func_lw,        func_ld,
@@ -1093,84 +1335,671 @@ static func_t *funcs[] = {
     func_fmv_x_d,  func_fcvt_d_l,  func_fcvt_d_lu, func_fmv_d_x,
 };
 
-#define CODEGEN_PROLOGUE                                \
-    "#define OFFSET 0x088800000000ULL               \n" \
-    "#define TO_HOST(addr) (addr + OFFSET)          \n" \
-    "enum exit_reason_t {                           \n" \
-    "   NONE,                                       \n" \
-    "   DIRECT_JMP,                              \n"    \
-    "   INDIRECT_JMP,                            \n"    \
-    "   INTERP,                                     \n" \
-    "   ecall,                                      \n" \
-    "};                                             \n" \
-    "typedef union {                                \n" \
-    "    uint64_t v;                                \n" \
-    "    uint32_t w;                                \n" \
-    "    double d;                                  \n" \
-    "    float f;                                   \n" \
-    "} fp_reg_t;                                    \n" \
-    "typedef struct {                               \n" \
-    "    enum exit_reason_t exit_reason;            \n" \
-    "    uint64_t reenter_pc;                       \n" \
-    "    uint64_t gp_regs[32];                      \n" \
-    "    fp_reg_t fp_regs[32];                      \n" \
-    "    uint64_t pc;                               \n" \
-    "    uint32_t fcsr;                             \n" \
-    "} state_t;                                     \n" \
-    "void start(volatile state_t *restrict state) { \n"
-
-#define CODEGEN_EPILOGUE "}"
+// fclass for a float of the given width, exponent mask and fraction bits
+#define CODEGEN_FCLASS(w, emask, fbits)                                    \
+    "static inline uint64_t fclass" #w "(uint" #w "_t a) {\n"              \
+    "    uint" #w "_t exp = (a >> " #fbits ") & " #emask ";\n"             \
+    "    uint" #w "_t frac = a & (((uint" #w "_t)1 << " #fbits ") - 1);\n" \
+    "    int sign = a >> (" #w " - 1);\n"                                  \
+    "    if (exp == " #emask ") {\n"                                       \
+    "        if (frac == 0) return sign ? 1 << 0 : 1 << 7;\n"              \
+    "        return frac >> (" #fbits " - 1) ? 1 << 9 : 1 << 8;\n"         \
+    "    }\n"                                                              \
+    "    if (exp == 0) {\n"                                                \
+    "        if (frac == 0) return sign ? 1 << 3 : 1 << 4;\n"              \
+    "        return sign ? 1 << 2 : 1 << 5;\n"                             \
+    "    }\n"                                                              \
+    "    return sign ? 1 << 1 : 1 << 6;\n"                                 \
+    "}\n"
+
+// index of the first byte two strings differ at or end, a word at a time
+// once both are aligned
+#define CODEGEN_MISMATCH                                                      \
+    "static inline uint64_t mismatch(const uint8_t *a, const uint8_t *b) {\n" \
+    "    uint64_t i = 0;\n"                                                   \
+    "    if ((((uintptr_t)a ^ (uintptr_t)b) & 7) == 0) {\n"                   \
+    "        for (; ((uintptr_t)(a + i) & 7) != 0; i++)\n"                    \
+    "            if (a[i] != b[i] || a[i] == 0) return i;\n"                  \
+    "        for (;; i += 8) {\n"                                             \
+    "            uint64_t x, y;\n"                                            \
+    "            __builtin_memcpy(&x, a + i, 8);\n"                           \
+    "            __builtin_memcpy(&y, b + i, 8);\n"                           \
+    "            if ((x ^ y) | ((x - 0x0101010101010101ULL) & ~x &\n"         \
+    "                           0x8080808080808080ULL))\n"                    \
+    "                break;\n"                                                \
+    "        }\n"                                                             \
+    "    }\n"                                                                 \
+    "    for (;; i++)\n"                                                      \
+    "        if (a[i] != b[i] || a[i] == 0) return i;\n"                      \
+    "}\n"
+
+// trips of a counted loop: stepping u by s until it equals e is
+// trips_ne(e - u, s), adding s while u < e trips_up and subtracting s while
+// u > e trips_down. 0 when u would wrap around first
+#define CODEGEN_TRIPS                                                         \
+    "static inline uint64_t trips_ne(uint64_t d, uint64_t s) {\n"             \
+    "    return d != 0 && d %% s == 0 ? d / s : 0;\n"                         \
+    "}\n"                                                                     \
+    "static inline uint64_t trips_up(uint64_t u, uint64_t e, uint64_t s) {\n" \
+    "    if (u > UINT64_MAX - s) return 0;\n"                                 \
+    "    if (u + s >= e) return 1;\n"                                         \
+    "    if (e - 1 > UINT64_MAX - s) return 0;\n"                             \
+    "    return (e - u - 1) / s + 1;\n"                                       \
+    "}\n"                                                                     \
+    "static inline uint64_t trips_down(uint64_t u, uint64_t e,\n"             \
+    "                                  uint64_t s) {\n"                       \
+    "    if (u < s) return 0;\n"                                              \
+    "    if (u - s <= e) return 1;\n"                                         \
+    "    if (e < s - 1) return 0;\n"                                          \
+    "    return (u - e - 1) / s + 1;\n"                                       \
+    "}\n"
+
+#define CODEGEN_PROLOGUE                                                      \
+    "#define OFFSET 0x088800000000ULL               \n"                       \
+    "#define TO_HOST(addr) (addr + OFFSET)          \n"                       \
+    "enum exit_reason_t {                           \n"                       \
+    "   NONE,                                       \n"                       \
+    "   DIRECT_JMP,                              \n"                          \
+    "   INDIRECT_JMP,                            \n"                          \
+    "   INTERP,                                     \n"                       \
+    "   ecall,                                      \n"                       \
+    "   INTERRUPT,                                  \n"                       \
+    "};                                             \n"                       \
+    "typedef union {                                \n"                       \
+    "    uint64_t v;                                \n"                       \
+    "    uint32_t w;                                \n"                       \
+    "    double d;                                  \n"                       \
+    "    float f;                                   \n"                       \
+    "} fp_reg_t;                                    \n"                       \
+    "typedef struct {                               \n"                       \
+    "    enum exit_reason_t exit_reason;            \n"                       \
+    "    uint64_t reenter_pc;                       \n"                       \
+    "    uint64_t gp_regs[32];                      \n"                       \
+    "    fp_reg_t fp_regs[32];                      \n"                       \
+    "    uint64_t pc;                               \n"                       \
+    "    uint32_t chain;                            \n"                       \
+    "    int64_t budget;                            \n"                       \
+    "    volatile uint32_t interrupt;               \n"                       \
+    "    uint64_t ras_top;                          \n"                       \
+    "    struct {                                   \n"                       \
+    "        uint64_t pc;                           \n"                       \
+    "        void **link;                           \n"                       \
+    "    } ras[%d];                                 \n"                       \
+    "} state_t;                                     \n"                       \
+    "typedef void (*block_func_t)(state_t *, uint64_t, uint64_t, uint64_t,\n" \
+    "                             uint64_t);\n"                               \
+    "typedef struct {                               \n"                       \
+    "    uint64_t hits;                             \n"                       \
+    "    uint64_t misses;                           \n"                       \
+    "    struct {                                   \n"                       \
+    "        uint64_t pc;                           \n"                       \
+    "        block_func_t code;                     \n"                       \
+    "    } table[];                                 \n"                       \
+    "} ibtc_t;                                      \n"                       \
+    CODEGEN_FCLASS(32, 0xff, 23)                                              \
+    CODEGEN_FCLASS(64, 0x7ff, 52)                                             \
+    CODEGEN_MISMATCH                                                          \
+    CODEGEN_TRIPS
+
+// the pinned guest registers come in as arguments, entry picks where the
+// region starts
+#define CODEGEN_START                                                \
+    "static void region(state_t *restrict state, uint64_t x%d,\n"    \
+    "                   uint64_t x%d, uint64_t x%d, uint64_t x%d,\n" \
+    "                   int entry) {\n"                              \
+    "    block_func_t next = 0;\n"                                   \
+    "    uint64_t target = 0;\n"                                     \
+    "    __typeof__(&state->ras[0]) ras;\n"
+
+// an exported entry point of the region, start is the one at its top
+#define CODEGEN_ENTRY                                                \
+    "void %s(state_t *restrict state, uint64_t x%d, uint64_t x%d,\n" \
+    "        uint64_t x%d, uint64_t x%d) {\n"
+
+#define CODEGEN_ENTRY_END                           \
+    "    region(state, x%d, x%d, x%d, x%d, %lu);\n" \
+    "}\n"
+
+// a marker pairs the host address it ends up at with the node's guest pc
+// and register homes, in a section machine_compile loads with the code.
+// the values are pasted into the directive, operands would have to fit in
+// 32 bits
+#define CODEGEN_MARK                                                        \
+    "#define MARK_STR(x) #x\n"                                              \
+    "#define MARK_XSTR(x) MARK_STR(x)\n"                                    \
+    "#define MARK(pc, homes) \\\n"                                          \
+    "    __asm__ volatile(\".Lmark%=:\\n\\t\" \\\n"                         \
+    "        \".pushsection .markers, \\\"a\\\"\\n\\t\" \\\n"               \
+    "        \".balign 8\\n\\t.quad .Lmark%=, \" MARK_XSTR(pc) \", \" \\\n" \
+    "        MARK_XSTR(homes) \"\\n\\t.popsection\" ::)\n"
+
+// a charged node leaves once the budget runs out or the host interrupts,
+// one branch on the common path
+#define CODEGEN_CHARGE                                           \
+    "    if (__builtin_expect(((state->budget -= %uLL) < 0) |\n" \
+    "                         state->interrupt, 0))\n"
+
+// the dynamic exits are charged one instruction
+#define CODEGEN_CHARGE_TARGET                     \
+    CODEGEN_CHARGE                                \
+    "    {\n"                                     \
+    "        state->exit_reason = INTERRUPT;\n"   \
+    "        state->reenter_pc = target;\n"       \
+    "        next = 0;\n"                         \
+    "        goto exit_%d;\n"                     \
+    "    }\n"
+
+// pop the return address stack, a matching entry chains to its block
+#define CODEGEN_RET                                \
+    "    if (ras->pc == target && *ras->link) {\n" \
+    "        next = (block_func_t)*ras->link;\n"   \
+    "        state->exit_reason = INDIRECT_JMP;\n" \
+    "        state->reenter_pc = target;\n"        \
+    "        goto exit_%d;\n"                      \
+    "    }\n"
+
+// probe the indirect branch translation cache before leaving the block
+#define CODEGEN_INDIRECT                            \
+    "    uint64_t index = (target >> 1) & %dULL;\n" \
+    "    if (ibtc->table[index].pc == target) {\n"  \
+    "        ibtc->hits++;\n"                       \
+    "        next = ibtc->table[index].code;\n"     \
+    "    } else {\n"                                \
+    "        ibtc->misses++;\n"                     \
+    "    }\n"
+
+#define CODEGEN_INDIRECT_EXIT                  \
+    "    state->exit_reason = INDIRECT_JMP;\n" \
+    "    state->reenter_pc = target;\n"        \
+    "    goto exit_%d;\n"
+
+// an exit that keeps leaving for its target asks for the region to be
+// re-formed and returns to the dispatcher, which does it
+#define CODEGEN_EXTEND_EXIT               \
+    "    if (++counts[%lu] == %dULL) {\n" \
+    "        extend[0] = %luULL;\n"       \
+    "        extend[1] = %luULL;\n"       \
+    "        next = 0;\n"                 \
+    "    }\n"
+
+// the indirect exit counts how often in a row it leaves for one target
+#define CODEGEN_EXTEND_INDIRECT                  \
+    "    if (counts[%lu] != target) {\n"         \
+    "        counts[%lu] = target;\n"            \
+    "        counts[%lu] = 0;\n"                 \
+    "    } else if (++counts[%lu] == %dULL) {\n" \
+    "        extend[0] = %luULL;\n"              \
+    "        extend[1] = target;\n"              \
+    "        next = 0;\n"                        \
+    "    }\n"
+
+// tail call into the chained block, if the exit was linked, otherwise
+// spill the pinned registers for the dispatcher. the call is not always a
+// sibling call, so every so many links the chain returns to the
+// dispatcher and the stack unwinds
+#define CODEGEN_EPILOGUE                         \
+    "    if (next && ++state->chain < %d) {\n"   \
+    "        next(state, x%d, x%d, x%d, x%d);\n" \
+    "        return;\n"                          \
+    "    }\n"                                    \
+    "    state->gp_regs[%d] = x%d;\n"            \
+    "    state->gp_regs[%d] = x%d;\n"            \
+    "    state->gp_regs[%d] = x%d;\n"            \
+    "    state->gp_regs[%d] = x%d;\n"            \
+    "}"
+
+static const char *gen_load_type(enum insn_type_t type) {
+    switch (type) {
+        case insn_lb:
+            return "int8_t";
+        case insn_lh:
+            return "int16_t";
+        case insn_lw:
+            return "int32_t";
+        case insn_ld:
+            return "int64_t";
+        case insn_lbu:
+        case insn_sb:
+            return "uint8_t";
+        case insn_lhu:
+        case insn_sh:
+            return "uint16_t";
+        case insn_lwu:
+        case insn_sw:
+            return "uint32_t";
+        default:
+            return "uint64_t";
+    }
+}
 
-/* generate C language code block */
-str_t machine_genblock(machine_t *m) {
-    DECLARE_STATIC_STR(body);
+// elements a copy or fill loop runs for, if the guard holds
+#define IDIOM_LIMIT "(1ULL << 40)"
+
+/*
+ * run a recognized loop as one library call when its trip count is known
+ * and the call behaves the same, the loop itself stays as the fallback.
+ * the call is charged what its trips would have been
+ */
+static str_t gen_idiom(str_t s, tracer_t *tracer, u64 i) {
+    static char buf[512] = {0};
+    ir_insn_t *node = &tracer->ir->insns[i];
+    ir_idiom_t *idiom = &node->idiom;
+    ir_insn_t *latch = &tracer->ir->insns[node->latch ? node->latch : i + 5];
+    u64 after = latch->pc + (latch->insn.rvc ? 2 : 4);
+    const char *typ = gen_load_type(idiom->load);
+    u64 w = idiom->width;
+
+    tracer->cur = i;
+    s = str_append(s, "    {\n");
+    if (idiom->src >= 0) {
+        REG_GET(idiom->src, src);
+    }
+    if (idiom->dst >= 0) {
+        REG_GET(idiom->dst, dst);
+    }
 
-    static stack_t stack = {0};
-    stack_reset(&stack);
+    switch (idiom->kind) {
+        case IR_IDIOM_STRLEN:
+            sprintf(buf,
+                    "    uint64_t n = ((uint64_t (*)(const char *))%luULL)("
+                    "(const char *)TO_HOST(src));\n",
+                    (u64)strlen);
+            s = str_append(s, buf);
+            REG_SET_VAL(idiom->val, 0L);
+            REG_SET_EXPR(idiom->src, "src + n + 1");
+            sprintf(buf,
+                    "    state->budget -= (n + 1) * %uULL;\n"
+                    "    goto insn_%lx;\n    }\n",
+                    node->charge, after);
+            return str_append(s, buf);
+        case IR_IDIOM_STRCMP:
+            sprintf(buf,
+                    "    uint64_t n = mismatch((const uint8_t *)TO_HOST(src), "
+                    "(const uint8_t *)TO_HOST(dst));\n"
+                    "    uint64_t a = *(%s *)TO_HOST(src + n);\n"
+                    "    uint64_t b = *(%s *)TO_HOST(dst + n);\n",
+                    typ, typ);
+            s = str_append(s, buf);
+            REG_SET_EXPR(idiom->val, "a");
+            REG_SET_EXPR(idiom->val2, "b");
+            REG_SET_EXPR(idiom->src, "src + n + 1");
+            REG_SET_EXPR(idiom->dst, "dst + n + 1");
+            sprintf(buf,
+                    "    state->budget -= (n + 1) * %uULL;\n"
+                    "    if (a != b) goto insn_%lx;\n"
+                    "    goto insn_%lx;\n    }\n",
+                    node->charge, idiom->out, after);
+            return str_append(s, buf);
+        default:
+            break;
+    }
 
-    static set_t set;
-    set_reset(&set);
+    REG_GET(idiom->end, lim);
+    const char *ptr = idiom->ptr == idiom->src ? "src" : "dst";
+    switch (idiom->bound) {
+        case IR_BOUND_NE:
+            sprintf(buf,
+                    "    uint64_t n = (lim - %s) / %lu;\n"
+                    "    bool run = (lim - %s) %% %lu == 0;\n",
+                    ptr, w, ptr, w);
+            break;
+        case IR_BOUND_LTU:
+            sprintf(buf,
+                    "    uint64_t n = (lim - %s + %lu) / %lu;\n"
+                    "    bool run = lim > %s;\n",
+                    ptr, w - 1, w, ptr);
+            break;
+        case IR_BOUND_COUNT:
+            sprintf(buf,
+                    "    uint64_t n = lim / %ldULL;\n"
+                    "    bool run = lim %% %ldULL == 0;\n",
+                    idiom->step, idiom->step);
+            break;
+    }
+    s = str_append(s, buf);
+
+    if (idiom->kind == IR_IDIOM_COPY) {
+        // an overlapping forward copy repeats its head, memmove does not
+        sprintf(buf,
+                "    if (run && n - 1 < " IDIOM_LIMIT
+                " && !(dst > src && dst - src < n * %lu)) {\n"
+                "    uint64_t val = *(%s *)TO_HOST(src + (n - 1) * %lu);\n"
+                "    ((void *(*)(void *, const void *, uint64_t))%luULL)("
+                "(void *)TO_HOST(dst), (const void *)TO_HOST(src), n * %lu);\n",
+                w, typ, w, (u64)memmove, w);
+        s = str_append(s, buf);
+        REG_SET_EXPR(idiom->val, "val");
+        sprintf(funcbuf2, "src + n * %lu", w);
+        REG_SET_EXPR(idiom->src, funcbuf2);
+    } else {
+        REG_GET(idiom->val, val);
+        sprintf(buf, "    if (run && n - 1 < " IDIOM_LIMIT ") {\n");
+        s = str_append(s, buf);
+        if (w == 1) {
+            sprintf(buf,
+                    "    ((void *(*)(void *, int, uint64_t))%luULL)("
+                    "(void *)TO_HOST(dst), (uint8_t)val, n);\n",
+                    (u64)memset);
+        } else {
+            sprintf(buf,
+                    "    for (uint64_t k = 0; k < n; k++)\n"
+                    "        ((%s *)TO_HOST(dst))[k] = (%s)val;\n",
+                    typ, typ);
+        }
+        s = str_append(s, buf);
+    }
 
-    static tracer_t tracer;
-    tracer_reset(&tracer);
+    sprintf(funcbuf2, "dst + n * %lu", w);
+    REG_SET_EXPR(idiom->dst, funcbuf2);
+    if (idiom->bound == IR_BOUND_COUNT) {
+        sprintf(funcbuf2, "lim - n * %ldULL", idiom->step);
+        REG_SET_EXPR(idiom->end, funcbuf2);
+    }
+    sprintf(buf,
+            "    state->budget -= n * %uULL;\n"
+            "    goto insn_%lx;\n    }\n    }\n",
+            node->charge, after);
+    return str_append(s, buf);
+}
+
+/* generate a region node, nodes inside a loop fall through to the next */
+static str_t gen_node(str_t s, tracer_t *tracer, u64 i, bool in_loop) {
+    static char buf[256] = {0};
+    ir_insn_t *node = &tracer->ir->insns[i];
+    insn_t *insn = &node->insn;
+
+    if (in_loop) {
+        s = str_append(s, "{\n");
+    } else {
+        sprintf(buf, "insn_%lx:\n", node->pc);
+        s = str_append(s, buf);
+        if (node->idiom.kind != IR_IDIOM_NONE) s = gen_idiom(s, tracer, i);
+        s = str_append(s, "{\n");
+    }
+    tracer->cur = i;
+    if (!in_loop) {
+        sprintf(buf, "    MARK(0x%lx, HOMES_%lu);\n", node->pc, i);
+        s = str_append(s, buf);
+    }
+    if (node->charge != 0 && node->op != IR_EXIT && !tracer->unchecked) {
+        sprintf(buf, CODEGEN_CHARGE "        goto interrupt_%lu;\n",
+                node->charge, i);
+        s = str_append(s, buf);
+    }
+
+    switch (node->op) {
+        case IR_EXIT:
+            s = str_append(s, "    state->exit_reason = DIRECT_JMP;\n");
+            sprintf(buf, "    state->reenter_pc = %luULL;\n", node->pc);
+            s = str_append(s, buf);
+            u64 link = tracer_add_link(tracer, node->pc);
+            sprintf(buf, "    next = links[%lu];\n", link);
+            s = str_append(s, buf);
+            sprintf(buf,
+                    CODEGEN_CHARGE
+                    "    {\n"
+                    "        state->exit_reason = INTERRUPT;\n"
+                    "        next = 0;\n"
+                    "    }\n",
+                    node->charge);
+            s = str_append(s, buf);
+            if (tracer->extendable && link != TRACER_UNLINKED) {
+                sprintf(buf, CODEGEN_EXTEND_EXIT, link, CACHE_EXTEND_COUNT,
+                        tracer->pc, node->pc);
+                s = str_append(s, buf);
+            }
+            sprintf(buf, "    goto exit_%lu;\n", i);
+            s = str_append(s, buf);
+            s = str_append(s, "}\n");
+            return s;
+        case IR_CALL:
+            return func_auipc_jalr(s, insn, &node->jalr, tracer, node->pc);
+        case IR_LI:
+            s = func_li(s, insn, tracer, node->value);
+            break;
+        case IR_NOP:
+            break;
+        case IR_INSN:
+            s = funcs[insn->type](s, insn, tracer, node->pc);
+            if (insn->continu) return s;
+            break;
+    }
+
+    if (!in_loop) {
+        sprintf(buf, "  goto insn_%lx;\n", node->pc + (insn->rvc ? 2 : 4));
+        s = str_append(s, buf);
+    }
+    s = str_append(s, "}\n");
+    return s;
+}
+
+/*
+ * open a scope holding the trips of counted loop h on the way in, 0 unless
+ * the latch ends it before the register it steps wraps around. a signed
+ * compare is made unsigned by flipping the sign bits
+ */
+static str_t gen_trips(str_t s, tracer_t *tracer, u64 h) {
+    static char buf[256] = {0};
+    ir_insn_t *node = &tracer->ir->insns[h];
+    insn_t *latch = &tracer->ir->insns[node->latch].insn;
+    i8 bound = latch->rs1 == node->iv ? latch->rs2 : latch->rs1;
+    u64 step = node->iv_step > 0 ? (u64)node->iv_step : -(u64)node->iv_step;
+    bool up = node->iv_step > 0;
+    const char *bias = "0ULL";
+    if (latch->type == insn_blt || latch->type == insn_bge)
+        bias = "0x8000000000000000ULL";
+
+    tracer->cur = h;
+    s = str_append(s, "    {\n");
+    REG_GET(node->iv, iv);
+    REG_GET(bound, lim);
+    if (latch->type == insn_bne) {
+        sprintf(buf, "    uint64_t trips = trips_ne(%s, %luULL);\n",
+                up ? "lim - iv" : "iv - lim", step);
+    } else if (latch->type == insn_blt || latch->type == insn_bltu) {
+        // iv < lim or lim < iv
+        sprintf(buf,
+                "    uint64_t trips = trips_%s(iv ^ %s, lim ^ %s, %luULL);\n",
+                up ? "up" : "down", bias, bias, step);
+    } else if (up) {
+        // lim >= iv is iv < lim + 1
+        sprintf(buf,
+                "    uint64_t trips = (lim ^ %s) == UINT64_MAX ? 0 :\n"
+                "        trips_up(iv ^ %s, (lim ^ %s) + 1, %luULL);\n",
+                bias, bias, bias, step);
+    } else {
+        // iv >= lim is iv > lim - 1
+        sprintf(buf,
+                "    uint64_t trips = (lim ^ %s) == 0 ? 0 :\n"
+                "        trips_down(iv ^ %s, (lim ^ %s) - 1, %luULL);\n",
+                bias, bias, bias, step);
+    }
+    return str_append(s, buf);
+}
 
-    stack_push(&stack, m->state.pc);
+/* leave a loop for the node after its latch */
+static str_t gen_after(str_t s, ir_region_t *ir, ir_insn_t *node) {
+    static char buf[64] = {0};
+    ir_insn_t *latch = &ir->insns[node->latch];
+    sprintf(buf, "    goto insn_%lx;\n", latch->pc + (latch->insn.rvc ? 2 : 4));
+    return str_append(s, buf);
+}
 
-    u64 pc = -1;
+/* generate the hot or the cold nodes of the region, in region order */
+static str_t gen_nodes(str_t s, tracer_t *tracer, bool cold) {
+    ir_region_t *ir = tracer->ir;
 
-    while (stack_pop(&stack, &pc)) {
-        if (!set_add(&set, pc)) {
+    for (u64 i = IR_NODE_ENTRY; i < ir->ninsns; i++) {
+        static char buf[256] = {0};
+        ir_insn_t *node = &ir->insns[i];
+        if (node->cold != cold) {
+            if (node->latch != 0) i = node->latch;
             continue;
         }
+        if (node->latch == 0) {
+            s = gen_node(s, tracer, i, false);
+            continue;
+        }
+
+        // a simple loop becomes a structured C loop
+        sprintf(buf, "insn_%lx:\n", node->pc);
+        s = str_append(s, buf);
+        if (node->idiom.kind != IR_IDIOM_NONE)
+            s = gen_idiom(s, tracer, i);
+        // inline asm in the loop would keep it from being vectorized, the
+        // header's marker stands for the whole body
+        sprintf(buf, "    MARK(0x%lx, HOMES_%lu);\n", node->pc, i);
+        s = str_append(s, buf);
+        tracer->loop_pc = node->pc;
+        // when a counted loop ends within the budget, the budget and the
+        // interrupt flag are checked once on the way in, so the loop keeps
+        // a single exit and can be vectorized. otherwise every trip checks
+        if (node->counted) {
+            s = gen_trips(s, tracer, i);
+            sprintf(buf,
+                    "    if (trips != 0 && state->budget >= 0 &&\n"
+                    "        trips <= (uint64_t)state->budget / %uULL &&\n"
+                    "        !state->interrupt) {\n"
+                    "    state->budget -= trips * %uULL;\n"
+                    "    for (;;) {\n",
+                    node->charge, node->charge);
+            s = str_append(s, buf);
+            tracer->unchecked = true;
+            for (u64 j = i; j <= node->latch; j++)
+                s = gen_node(s, tracer, j, true);
+            tracer->unchecked = false;
+            s = str_append(s, "    break;\n    }\n");
+            s = gen_after(s, ir, node);
+            s = str_append(s, "    }\n    }\n");
+        }
+        s = str_append(s, "    for (;;) {\n");
+        for (u64 j = i; j <= node->latch; j++)
+            s = gen_node(s, tracer, j, true);
+        tracer->loop_pc = 0;
+        s = str_append(s, "    break;\n    }\n");
+        s = gen_after(s, ir, node);
+        i = node->latch;
+    }
+    return s;
+}
 
-        static char buf[128] = {0};
-        static insn_t insn = {0};
+/* generate C language code block */
+str_t machine_genblock(machine_t *m, u64 pc) {
+    DECLARE_STATIC_STR(body);
 
-        sprintf(buf, "insn_%lx: {\n", pc);
-        body = str_append(body, buf);
+    cache_region_t *region = cache_region(m->cache, pc);
+    static ir_region_t ir;
+    ir_build(&ir, pc, region->extends, region->nextends);
+    for (u64 k = 0; k < region->nspecs; k++) {
+        ir.consts |= 1U << region->spec_regs[k];
+        ir.vals[region->spec_regs[k]] = region->spec_vals[k];
+    }
+    ir_optimize(&ir);
+    ir_loops(&ir);
+    ir_slots(&ir);
+    ir_idioms(&ir);
+#if IR_PREFETCH
+    ir_prefetch(&ir);
+#endif
+    ir_layout(&ir);
+    ir_entries(&ir);
 
-        u32 data = *(u32 *)TO_HOST(pc);
-        insn_decode(&insn, data);
-        body = funcs[insn.type](body, &insn, &tracer, &stack, pc);
+    static tracer_t tracer;
+    tracer_reset(&tracer, &ir);
+    tracer.pc = pc;
+    tracer.extendable = region->nextends < CACHE_EXTENDS;
 
-        if (insn.continu) continue;
+    // register usage is recorded again from the generated code
+    for (u64 i = 0; i < ir.ninsns; i++) ir.insns[i].use = ir.insns[i].def = 0;
 
-        pc += (insn.rvc ? 2 : 4);
-        sprintf(buf, "  goto insn_%lx;\n", pc);
-        body = str_append(body, buf);
-        body = str_append(body, "}\n");
-        stack_push(&stack, pc);
-    }
+    // cold nodes go last so the hot paths fall through
+    body = gen_nodes(body, &tracer, false);
+    body = gen_nodes(body, &tracer, true);
     /* the whole C code block */
+    static char buf[4096] = {0};
     DECLARE_STATIC_STR(source);
     source = str_append(source, "#include <stdint.h>\n");
     source = str_append(source, "#include <stdbool.h>\n");
-    source = str_append(source, CODEGEN_PROLOGUE);
+    sprintf(buf, CODEGEN_PROLOGUE, RAS_SIZE);
+    source = str_append(source, buf);
+    source = str_append(source, CODEGEN_MARK);
+    sprintf(buf, CODEGEN_START, pinned[0], pinned[1], pinned[2], pinned[3]);
+    source = str_append(source, buf);
+    if (tracer.nlinks > 0) {
+        u8 **links =
+            cache_alloc_links(m->cache, tracer.link_pcs, tracer.nlinks);
+        sprintf(buf, "    block_func_t *links = (block_func_t *)%luULL;\n",
+                (u64)links);
+        source = str_append(source, buf);
+    }
+    sprintf(buf, "    ibtc_t *ibtc = (ibtc_t *)%luULL;\n",
+            (u64)&m->cache->ibtc);
+    source = str_append(source, buf);
+    if (tracer.extendable) {
+        // one counter per exit slot, then the indirect exit's target and run
+        u64 *counts = (u64 *)cache_append(
+            m->cache, NULL, (tracer.nlinks + 2) * sizeof(u64), sizeof(u64));
+        sprintf(buf,
+                "    uint64_t *counts = (uint64_t *)%luULL;\n"
+                "    uint64_t *extend = (uint64_t *)%luULL;\n",
+                (u64)counts, (u64)&m->cache->extend);
+        source = str_append(source, buf);
+    }
+    ir_dataflow(&ir);
     source = tracer_append_prologue(&tracer, source);
+    source = tracer_append_entries(&tracer, source);
+    // a register written on the way to a node is only current in its local
+    for (u64 i = IR_NODE_ENTRY; i < ir.ninsns; i++) {
+        sprintf(buf, "#define HOMES_%lu 0x%lx\n", i,
+                (u64)(ir.insns[i].dirty | PINNED_REGS));
+        source = str_append(source, buf);
+    }
     source = str_append(source, body);
-    source = str_append(source, "end:;\n");
+    sprintf(buf, "ret:\n    ras = &state->ras[state->ras_top-- & %d];\n",
+            RAS_SIZE - 1);
+    source = str_append(source, buf);
+    sprintf(buf, CODEGEN_CHARGE_TARGET, 1, IR_NODE_RET);
+    source = str_append(source, buf);
+    source = tracer_append_rets(&tracer, source);
+    sprintf(buf, CODEGEN_RET "indirect:;\n" CODEGEN_CHARGE_TARGET, IR_NODE_RET,
+            1, IR_NODE_INDIRECT);
+    source = str_append(source, buf);
+    source = tracer_append_extends(&tracer, source);
+    sprintf(buf, CODEGEN_INDIRECT, CACHE_IBTC_SIZE - 1);
+    source = str_append(source, buf);
+    if (tracer.extendable) {
+        u64 n = tracer.nlinks;
+        sprintf(buf, CODEGEN_EXTEND_INDIRECT, n, n, n + 1, n + 1,
+                CACHE_EXTEND_COUNT, pc);
+        source = str_append(source, buf);
+    }
+    sprintf(buf, CODEGEN_INDIRECT_EXIT, IR_NODE_INDIRECT);
+    source = str_append(source, buf);
     source = tracer_append_epilogue(&tracer, source);
-    source = str_append(source, CODEGEN_EPILOGUE);
+    source = str_append(source, "end:;\n");
+    sprintf(buf, CODEGEN_EPILOGUE, CACHE_CHAIN_DEPTH, pinned[0], pinned[1],
+            pinned[2], pinned[3], pinned[0], pinned[0], pinned[1], pinned[1],
+            pinned[2], pinned[2], pinned[3], pinned[3]);
+    source = str_append(source, buf);
+
+    // machine_compile registers the entry points by their symbol names
+    for (u64 k = 0; k <= ir.nentries; k++) {
+        static char name[32] = {0};
+        if (k == 0)
+            strcpy(name, "start");
+        else
+            sprintf(name, "entry_%lx", ir.insns[ir.entries[k - 1]].pc);
+        sprintf(buf, "\n" CODEGEN_ENTRY, name, pinned[0], pinned[1],
+                pinned[2], pinned[3]);
+        source = str_append(source, buf);
+        if (k == 0 && region->nspecs > 0)
+            source = tracer_append_guard(&tracer, source, region);
+        else if (k == 0)
+            source = tracer_append_profile(&tracer, source, m->cache, region);
+        sprintf(buf, CODEGEN_ENTRY_END, pinned[0], pinned[1], pinned[2],
+                pinned[3], k);
+        source = str_append(source, buf);
+    }
 
     return source;
 }
\ No newline at end of file
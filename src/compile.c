@@ -1,100 +1,313 @@
+#define _GNU_SOURCE
 #include "emulator.h"
 
-#define BINBUF_CAP 64 * 1024
+#include <spawn.h>
 
-// compile into binary program
-static u8 elfbuf[BINBUF_CAP] = {0};
+extern char **environ;
 
-/* compile C code into binary by clang */
-u8 *machine_compile(machine_t *m, str_t source) {
-    int saved_stdout = dup(STDOUT_FILENO);
-    int outp[2];
-
-    // output to stdout
-    if (pipe(outp) != 0) Fatal("cannot make a pipe");
-    dup2(outp[1], STDOUT_FILENO);
-    close(outp[1]);
+/* an anonymous in-memory file holding data, shared with clang */
+static int compile_memfd(const char *name, const char *data, u64 len) {
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd < 0) Fatal("cannot make a memory file");
+    for (u64 done = 0; done < len;) {
+        ssize_t n = pwrite(fd, data + done, len - done, done);
+        if (n <= 0) Fatal("cannot write a memory file");
+        done += n;
+    }
+    return fd;
+}
 
-    FILE *f;
-    f = popen("clang -O3 -c -xc -o /dev/stdout -", "w");
-    if (f == NULL) Fatal("cannot compile program");
+/*
+ * compile C code into an object with clang. clang is spawned without a
+ * shell, it reads the source from one memory file and writes the object
+ * into another. both only become its stdin and fd 3, the emulator's own
+ * descriptors are left alone so that compilers can run on many threads
+ * while the guest writes to stdout
+ */
+static u8 *compile_object(const char *source, u64 len, u64 *size) {
+    int src = compile_memfd("source", source, len);
+    int obj = compile_memfd("object", NULL, 0);
 
-    fwrite(source, 1, str_len(source), f);
-    pclose(f);
-    fflush(stdout);
+    // blocks are not linked against libc, keep clang from calling into it.
+    // they only ever run on this host, so tune for its CPU, but keep every
+    // guest fp instruction rounding on its own
+    char *argv[] = {
+        "clang", "-O3", "-march=native", "-ffp-contract=off",
+        "-fno-math-errno", "-fno-builtin", "-fno-asynchronous-unwind-tables",
+        "-c", "-xc", "-o", "/dev/fd/3", "-", NULL,
+    };
 
-    (void)read(outp[0], elfbuf, BINBUF_CAP);
-    dup2(saved_stdout, STDOUT_FILENO);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, src, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, obj, 3);
 
-    elf64_ehdr_t *ehdr = (elf64_ehdr_t *)elfbuf;
+    pid_t pid;
+    int status = -1;
+    if (posix_spawnp(&pid, "clang", &actions, NULL, argv, environ) == 0) {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    close(src);
 
-    /* generate sections */
-    i64 text_idx = 0, symtab_idx = 0, rela_idx = 0, rodata_idx = 0;
-    {
-        u64 shstr_shoff =
-            ehdr->e_shoff + ehdr->e_shstrndx * sizeof(elf64_shdr_t);
-        elf64_shdr_t *shstr_shdr = (elf64_shdr_t *)(elfbuf + shstr_shoff);
-        assert(ehdr->e_shnum != 0);
-
-        for (i64 idx = 0; idx < ehdr->e_shnum; idx++) {
-            u64 shoff = ehdr->e_shoff + idx * sizeof(elf64_shdr_t);
-            elf64_shdr_t *shdr = (elf64_shdr_t *)(elfbuf + shoff);
-            char *str =
-                (char *)(elfbuf + shstr_shdr->sh_offset + shdr->sh_name);
-            if (strcmp(str, ".text") == 0) text_idx = idx;
-            if (strcmp(str, ".rela.text") == 0) rela_idx = idx;
-            if (strncmp(str, ".rodata.", strlen(".rodata.")) == 0)
-                rodata_idx = idx;
-            if (strcmp(str, ".symtab") == 0) symtab_idx = idx;
+    struct stat st;
+    u8 *elf = NULL;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+        fstat(obj, &st) == 0 && st.st_size > 0) {
+        elf = (u8 *)malloc(st.st_size);
+        for (u64 done = 0; elf != NULL && done < (u64)st.st_size;) {
+            ssize_t n = pread(obj, elf + done, st.st_size - done, done);
+            if (n <= 0) {
+                free(elf);
+                elf = NULL;
+            } else {
+                done += n;
+            }
         }
     }
+    close(obj);
+    *size = elf ? st.st_size : 0;
+    return elf;
+}
 
-    assert(text_idx != 0 && symtab_idx != 0);
+/* load a compiled region into the code cache and register its entries */
+static u8 *compile_load(machine_t *m, u64 pc, u8 *elfbuf) {
+    elf64_ehdr_t *ehdr = (elf64_ehdr_t *)elfbuf;
+    assert(ehdr->e_shnum != 0);
 
-    u64 text_shoff = ehdr->e_shoff + text_idx * sizeof(elf64_shdr_t);
-    elf64_shdr_t *text_shdr = (elf64_shdr_t *)(elfbuf + text_shoff);
+    elf64_shdr_t *shdrs = (elf64_shdr_t *)(elfbuf + ehdr->e_shoff);
+    char *shstrtab = (char *)(elfbuf + shdrs[ehdr->e_shstrndx].sh_offset);
 
-    if (rela_idx == 0 || rodata_idx == 0) {
-        return cache_add(m->cache, m->state.pc, elfbuf + text_shdr->sh_offset,
-                         text_shdr->sh_size, text_shdr->sh_addralign);
-    }
+    /* load every allocated section, .text goes last */
+    i64 text_idx = 0, symtab_idx = 0, markers_idx = 0;
+    u64 addrs[ehdr->e_shnum];
+    memset(addrs, 0, sizeof(addrs));
+
+    for (i64 idx = 0; idx < ehdr->e_shnum; idx++) {
+        elf64_shdr_t *shdr = &shdrs[idx];
+        char *str = shstrtab + shdr->sh_name;
+        if (strcmp(str, ".text") == 0) text_idx = idx;
+        if (strcmp(str, ".symtab") == 0) symtab_idx = idx;
+        if (strcmp(str, ".markers") == 0) markers_idx = idx;
 
-    u64 text_addr = 0;
-    {
-        u64 shoff = ehdr->e_shoff + rodata_idx * sizeof(elf64_shdr_t);
-        elf64_shdr_t *shdr = (elf64_shdr_t *)(elfbuf + shoff);
-        cache_add(m->cache, m->state.pc, elfbuf + shdr->sh_offset,
-                  shdr->sh_size, shdr->sh_addralign);
-        text_addr =
-            (u64)cache_add(m->cache, m->state.pc, elfbuf + text_shdr->sh_offset,
-                           text_shdr->sh_size, text_shdr->sh_addralign);
+        if (!(shdr->sh_flags & SHF_ALLOC) || shdr->sh_size == 0 ||
+            strcmp(str, ".text") == 0)
+            continue;
+
+        u8 *data =
+            shdr->sh_type == SHT_NOBITS ? NULL : elfbuf + shdr->sh_offset;
+        addrs[idx] = (u64)cache_append(m->cache, data, shdr->sh_size,
+                                       shdr->sh_addralign);
     }
 
-    // apply relocations to .text section.
-    {
-        u64 shoff = ehdr->e_shoff + rela_idx * sizeof(elf64_shdr_t);
-        elf64_shdr_t *shdr = (elf64_shdr_t *)(elfbuf + shoff);
-        i64 rels = shdr->sh_size / sizeof(elf64_rela_t);
+    assert(text_idx != 0 && symtab_idx != 0);
+
+    elf64_shdr_t *text_shdr = &shdrs[text_idx];
+    addrs[text_idx] =
+        (u64)cache_append(m->cache, elfbuf + text_shdr->sh_offset,
+                          text_shdr->sh_size, text_shdr->sh_addralign);
+
+    // apply relocations to every loaded section.
+    elf64_shdr_t *symtab_shdr = &shdrs[symtab_idx];
+    for (i64 idx = 0; idx < ehdr->e_shnum; idx++) {
+        elf64_shdr_t *shdr = &shdrs[idx];
+        if (shdr->sh_type != SHT_RELA || addrs[shdr->sh_info] == 0) continue;
 
-        u64 symtab_shoff = ehdr->e_shoff + symtab_idx * sizeof(elf64_shdr_t);
-        elf64_shdr_t *symtab_shdr = (elf64_shdr_t *)(elfbuf + symtab_shoff);
+        u64 base = addrs[shdr->sh_info];
+        i64 rels = shdr->sh_size / sizeof(elf64_rela_t);
 
-        for (i64 idx = 0; idx < rels; idx++) {
+        for (i64 i = 0; i < rels; i++) {
 #ifndef __x86_64__
             Fatal("only support x86_64 for now");
 #endif
             elf64_rela_t *rel = (elf64_rela_t *)(elfbuf + shdr->sh_offset +
-                                                 idx * sizeof(elf64_rela_t));
-            assert(rel->r_type == R_X86_64_PC32);
-
+                                                 i * sizeof(elf64_rela_t));
             elf64_sym_t *sym =
                 (elf64_sym_t *)(elfbuf + symtab_shdr->sh_offset +
                                 rel->r_sym * sizeof(elf64_sym_t));
-            u32 *loc = (u32 *)(text_addr + rel->r_offset);
-            *loc =
-                (u32)((i64)sym->st_value + rel->r_addend - (i64)rel->r_offset);
+            if (addrs[sym->st_shndx] == 0) Fatal("undefined symbol in block");
+
+            u64 s = addrs[sym->st_shndx] + sym->st_value;
+            u64 p = base + rel->r_offset;
+            switch (rel->r_type) {
+                case R_X86_64_PC32:
+                case R_X86_64_PLT32:
+                    *(u32 *)p = (u32)(s + rel->r_addend - p);
+                    break;
+                case R_X86_64_64:
+                    *(u64 *)p = s + rel->r_addend;
+                    break;
+                default:
+                    Fatal("unsupported relocation");
+            }
         }
     }
 
-    return (u8 *)text_addr;
-}
\ No newline at end of file
+    // the markers hold host addresses now, they go in the lookup table
+    cache_add_code(m->cache, (u8 *)addrs[text_idx], text_shdr->sh_size,
+                   (cache_marker_t *)addrs[markers_idx],
+                   markers_idx ? shdrs[markers_idx].sh_size /
+                                     sizeof(cache_marker_t)
+                               : 0);
+
+    // register start for the region's pc and entry_<pc> for its labels, a
+    // region re-formed for pc retires the entries of its old code
+    cache_region_t *region = cache_region(m->cache, pc);
+    u8 *old = region->text;
+    u64 old_size = region->size;
+    region->text = (u8 *)addrs[text_idx];
+    region->size = text_shdr->sh_size;
+
+    char *strtab = (char *)(elfbuf + shdrs[symtab_shdr->sh_link].sh_offset);
+    i64 syms = symtab_shdr->sh_size / sizeof(elf64_sym_t);
+    u8 *start = NULL;
+    for (i64 i = 0; i < syms; i++) {
+        elf64_sym_t *sym = (elf64_sym_t *)(elfbuf + symtab_shdr->sh_offset +
+                                           i * sizeof(elf64_sym_t));
+        char *name = strtab + sym->st_name;
+        u8 *code = (u8 *)addrs[text_idx] + sym->st_value;
+        u64 entry_pc;
+        if (sym->st_shndx != text_idx) continue;
+
+        if (strcmp(name, "start") == 0) {
+            start = code;
+        } else if (sscanf(name, "entry_%lx", &entry_pc) == 1) {
+            // a region compiled for the pc itself is a better entry
+            u8 *cur = cache_lookup(m->cache, entry_pc);
+            if (cur == NULL || (cur >= old && cur < old + old_size))
+                cache_add(m->cache, entry_pc, code, sym->st_size);
+        }
+    }
+    assert(start != NULL);
+
+    cache_add(m->cache, pc, start, text_shdr->sh_size);
+    return start;
+}
+
+/* compile and load a region on the calling thread */
+u8 *machine_compile(machine_t *m, u64 pc, str_t source) {
+    u64 size;
+    u8 *elf = compile_object(source, str_len(source), &size);
+    if (elf == NULL) Fatal("cannot compile program");
+    u8 *code = compile_load(m, pc, elf);
+    free(elf);
+    return code;
+}
+
+// regions handed to the background compilers. only the guest thread queues
+// and frees jobs, only the workers run them, all under the lock
+static compile_job_t jobs[COMPILE_JOBS];
+static u64 njobs;  // jobs ever queued, orders jobs of equal hotness
+static u64 ndone;  // done jobs not loaded yet
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+/* each worker runs its own clang, taking the hottest queued region first */
+static void *compile_worker(void *arg) {
+    pthread_mutex_lock(&jobs_lock);
+    while (true) {
+        compile_job_t *job = NULL;
+        for (u64 i = 0; i < COMPILE_JOBS; i++) {
+            if (jobs[i].state != COMPILE_QUEUED) continue;
+            if (job == NULL || jobs[i].hotness > job->hotness ||
+                (jobs[i].hotness == job->hotness && jobs[i].seq < job->seq))
+                job = &jobs[i];
+        }
+        if (job == NULL) {
+            pthread_cond_wait(&jobs_cond, &jobs_lock);
+            continue;
+        }
+
+        job->state = COMPILE_RUNNING;
+        pthread_mutex_unlock(&jobs_lock);
+        job->object = compile_object(job->source, job->len, &job->size);
+        pthread_mutex_lock(&jobs_lock);
+        job->state = COMPILE_DONE;
+        __atomic_add_fetch(&ndone, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* start one worker per host cpu besides the guest's own */
+static void compile_start() {
+    i64 ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    i64 nworkers = MIN(MAX(ncpus - 1, (i64)1), (i64)COMPILE_WORKERS);
+    for (i64 i = 0; i < nworkers; i++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, compile_worker, NULL) != 0)
+            Fatal("cannot start the compiler threads");
+        pthread_detach(worker);
+    }
+}
+
+/* queue a region for the background compilers, false if the queue is full */
+bool machine_compile_async(machine_t *m, u64 pc, str_t source) {
+    static bool started = false;
+    if (!started) {
+        compile_start();
+        started = true;
+    }
+
+    pthread_mutex_lock(&jobs_lock);
+    compile_job_t *job = NULL;
+    for (u64 i = 0; i < COMPILE_JOBS && job == NULL; i++) {
+        if (jobs[i].state == COMPILE_FREE) job = &jobs[i];
+    }
+    if (job != NULL) {
+        job->pc = pc;
+        job->epoch = m->cache->epoch;
+        job->seq = njobs++;
+        job->hotness = cache_hotness(m->cache, pc);
+        job->len = str_len(source);
+        job->source = (char *)malloc(job->len);
+        memcpy(job->source, source, job->len);
+        job->state = COMPILE_QUEUED;
+        pthread_cond_signal(&jobs_cond);
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    return job != NULL;
+}
+
+/*
+ * whether a region at pc is queued or being compiled, a pc is only ever in
+ * one job. a queued region takes the hotness the pc has reached since
+ */
+bool machine_compiling(machine_t *m, u64 pc) {
+    compile_job_t *job = NULL;
+    pthread_mutex_lock(&jobs_lock);
+    for (u64 i = 0; i < COMPILE_JOBS && job == NULL; i++) {
+        if (jobs[i].state != COMPILE_FREE && jobs[i].pc == pc) job = &jobs[i];
+    }
+    if (job != NULL && job->state == COMPILE_QUEUED)
+        job->hotness = MAX(job->hotness, cache_hotness(m->cache, pc));
+    pthread_mutex_unlock(&jobs_lock);
+    return job != NULL;
+}
+
+/*
+ * load the regions the background compilers finished. this runs on the
+ * guest thread between blocks, so a region's code and entries appear in
+ * the cache all at once. code generated before a flush refers to memory
+ * that is gone and is dropped, its region is generated again when next hot
+ */
+void machine_compile_poll(machine_t *m) {
+    while (__atomic_load_n(&ndone, __ATOMIC_ACQUIRE) > 0) {
+        compile_job_t done = {0};
+        pthread_mutex_lock(&jobs_lock);
+        for (u64 i = 0; i < COMPILE_JOBS; i++) {
+            if (jobs[i].state != COMPILE_DONE) continue;
+            done = jobs[i];
+            jobs[i].state = COMPILE_FREE;
+            __atomic_sub_fetch(&ndone, 1, __ATOMIC_RELEASE);
+            break;
+        }
+        pthread_mutex_unlock(&jobs_lock);
+
+        if (done.object == NULL) Fatal("cannot compile program");
+        if (done.epoch == m->cache->epoch && !cache_full(m->cache))
+            compile_load(m, done.pc, done.object);
+        free(done.source);
+        free(done.object);
+    }
+}
@@ -24,7 +24,14 @@
 #define PT_W 0x2
 #define PT_R 0x4
 
+#define SHT_RELA 4
+#define SHT_NOBITS 8
+
+#define SHF_ALLOC 0x2
+
+#define R_X86_64_64 1
 #define R_X86_64_PC32 2
+#define R_X86_64_PLT32 4
 
 typedef struct {
     u8 e_ident[EI_IDENT_NUM];
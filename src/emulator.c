@@ -12,6 +12,12 @@ int main(int argc, char** argv) {
 
     while (true) {
         enum exit_reason_t reason = machine_step(&machine);
+        if (reason == INTERRUPT) {
+            // nothing schedules the guest yet, let it run on
+            machine.state.interrupt = 0;
+            machine.state.budget = INT64_MAX;
+            continue;
+        }
         assert(reason == ECALL);
 
         u64 syscall = machine_get_gp_reg(&machine, a7);
@@ -6,6 +6,8 @@
 #include <error.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -17,6 +19,13 @@
 #include <sys/time.h>
 #include <unistd.h>
 
+// the host's signal.h has a stack_t of its own, it is host_stack_t here
+#define stack_t host_stack_t
+#include <signal.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#undef stack_t
+
 #include "elf.h"
 #include "reg.h"
 #include "types.h"
@@ -245,36 +254,135 @@ enum exit_reason_t {
     INDIRECT_JMP,
     INTERP,
     ECALL,
+    INTERRUPT,  // the instruction budget ran out or the host interrupted
 };
 
+#define RAS_SIZE 64
+
+typedef struct {
+    u64 pc;     // guest return address
+    u8 **link;  // exit slot of the block compiled for it
+} ras_entry_t;
+
 typedef struct {
     enum exit_reason_t exit_reason;  // 跳出原因
     u64 reenter_pc;                  // 返回的pc地址
     u64 gp_regs[num_gp_regs];        // 通用寄存器
     fp_reg_t fp_regs[num_fp_regs];   // 浮点寄存器
     u64 pc;                          // 程序执行的位置
+    u32 chain;                       // 未回到分发器时连续链接的块数
+    i64 budget;                      // 剩余指令预算，耗尽时 INTERRUPT
+    volatile u32 interrupt;          // 宿主异步请求中断
+    u64 ras_top;                     // 影子返回地址栈
+    ras_entry_t ras[RAS_SIZE];
 } state_t;
 
 /* cache.c */
 #define CACHE_ENTRY_SIZE (64 * 1024)
 #define CACHE_SIZE (64 * 1024 * 1024)
+#define CACHE_LINK_SIZE (64 * 1024)
+#define CACHE_BLOCK_LINKS 1024  // exit slots a single block may reserve
+#define CACHE_CHAIN_DEPTH 256  // chained calls before one returns instead
+#define CACHE_IBTC_SIZE 4096
+#define CACHE_IBTC_HASH(pc) (((pc) >> 1) & (CACHE_IBTC_SIZE - 1))
+#define CACHE_REGION_SIZE 4096
+#define CACHE_REGION_HASH(pc) (((pc) >> 1) & (CACHE_REGION_SIZE - 1))
+#define CACHE_EXTENDS 4  // hot exit targets a region can be re-formed with
+#define CACHE_EXTEND_COUNT 10000  // exits to one target that re-form it
+#define CACHE_SPECS 8  // live-in registers profiled at a region's entry
+#define CACHE_PROFILE_COUNT 1000  // entries profiled before specializing
+#define CACHE_SPEC_CHANGES 8  // value changes a near-constant register has
+#define CACHE_CODES 16384  // compiled region texts the marker tables cover
 
 typedef struct {
     u64 pc;
     u64 hot;
     u64 offset;
+    bool compiled;  // offset holds the code of the block
 } cache_item_t;
 
+// indirect branch translation cache, probed inline by compiled blocks
+typedef struct {
+    u64 hits;
+    u64 misses;
+    struct {
+        u64 pc;
+        u8 *code;
+    } table[CACHE_IBTC_SIZE];
+} ibtc_t;
+
+// what a region was re-formed with, and where its current code lives
+typedef struct {
+    u64 pc;
+    u64 nextends;
+    u64 extends[CACHE_EXTENDS];  // exit targets the region now includes
+    u8 *text;
+    u64 size;
+
+    // entries so far, then the last value and the number of changes of each
+    // profiled register
+    u64 *profile;
+    u64 nprofiled;
+    i8 profiled[CACHE_SPECS];
+    // registers the region is specialized on, guarded at its entry
+    u64 nspecs;
+    i8 spec_regs[CACHE_SPECS];
+    u64 spec_vals[CACHE_SPECS];
+    u8 *generic;  // code the guard falls back to
+} cache_region_t;
+
+// a point in compiled code and the guest state there: the pc of the guest
+// instruction that runs next and the registers whose values live in host
+// locals, the others are up to date in state_t. the body of a structured
+// loop only has its header's marker
+typedef struct {
+    u8 *code;
+    u64 pc;
+    u64 homes;
+} cache_marker_t;
+
+// the text of one compilation and its markers, sorted by address
+typedef struct {
+    u8 *text;
+    u64 size;
+    cache_marker_t *markers;
+    u64 nmarkers;
+} cache_code_t;
+
 typedef struct {
     u8 *jitcode;
     u64 offset;
     cache_item_t table[CACHE_ENTRY_SIZE];
+    u64 nlinks;
+    u8 *links[CACHE_LINK_SIZE];      // exit slots of compiled blocks
+    u64 link_pcs[CACHE_LINK_SIZE];  // guest pc each exit slot jumps to
+    ibtc_t ibtc;
+    cache_region_t regions[CACHE_REGION_SIZE];
+    // set by a compiled block whose exit kept leaving for the same target
+    struct {
+        u64 pc;
+        u64 target;
+    } extend;
+    u64 specialize;  // region whose entry profile is complete, or 0
+    u64 epoch;       // flushes so far, code generated before one is stale
+    u64 ncodes;
+    cache_code_t codes[CACHE_CODES];  // in address order, as compiled
 } cache_t;
 
 cache_t *new_cache();
 u8 *cache_lookup(cache_t *, u64);
-u8 *cache_add(cache_t *, u64, u8 *, size_t, u64);
+u8 *cache_append(cache_t *, u8 *, size_t, u64);
+void cache_add(cache_t *, u64, u8 *, size_t);
 bool cache_hot(cache_t *, u64);
+u64 cache_hotness(cache_t *, u64);
+u8 **cache_alloc_links(cache_t *, u64 *, u64);
+void cache_ibtc_add(cache_t *, u64, u8 *);
+bool cache_full(cache_t *);
+void cache_flush(cache_t *);
+cache_region_t *cache_region(cache_t *, u64);
+bool cache_extend(cache_t *, u64, u64);
+void cache_add_code(cache_t *, u8 *, u64, cache_marker_t *, u64);
+cache_marker_t *cache_marker(cache_t *, u8 *);
 
 /* str.c */
 #define STR_MAX_PREALLOC (1024 * 1024)
@@ -330,6 +438,130 @@ bool set_has(set_t *, u64);
 bool set_add(set_t *, u64);
 void set_reset(set_t *);
 
+/* ir.c */
+#define IR_REGION_INSNS 512  // region size, blocks are chained beyond it
+#define IR_EXTEND_INSNS 128  // instructions a hot exit target adds to it
+#define IR_MAX_EXTENDS CACHE_EXTENDS
+#define IR_MAX_INSNS (IR_REGION_INSNS + IR_MAX_EXTENDS * IR_EXTEND_INSNS)
+// every time the budget runs out up to a stack of pcs become exits
+#define IR_MAX_NODES (IR_MAX_INSNS + (IR_MAX_EXTENDS + 1) * STACK_CAP)
+#define IR_MAX_SLOTS 32  // guest stack slots kept in host locals
+// prefetch ahead of strided loads in loops, off until it shows a gain.
+// bench/prefetch times both settings
+#ifndef IR_PREFETCH
+#define IR_PREFETCH 0
+#endif
+#define IR_MAX_ENTRIES 16  // labels a region exports besides its entry
+
+// register sets are bitmasks, bit i is x<i> and bit 32 + i is f<i>
+#define GP_REG(reg) (1ULL << (reg))
+#define FP_REG(reg) (1ULL << (32 + (reg)))
+
+// the pseudo nodes behind a region's shared return and indirect exits
+#define IR_NODE_RET 0
+#define IR_NODE_INDIRECT 1
+#define IR_NODE_ENTRY 2
+
+enum ir_op_t {
+    IR_INSN,  // a guest instruction
+    IR_CALL,  // auipc+jalr with a known target
+    IR_LI,    // rd = value, a folded instruction
+    IR_NOP,   // removed instruction or pseudo node
+    IR_EXIT,  // region limit, leaves the region for pc
+};
+
+// loop shapes a header runs as one library routine
+enum ir_idiom_kind_t {
+    IR_IDIOM_NONE,
+    IR_IDIOM_COPY,    // *dst++ = val = *src++
+    IR_IDIOM_FILL,    // *dst++ = val
+    IR_IDIOM_STRLEN,  // val = *src++, until val == 0
+    IR_IDIOM_STRCMP,  // val = *src++, val2 = *dst++, until they differ or 0
+};
+
+// how a copy or fill loop counts its iterations
+enum ir_bound_t {
+    IR_BOUND_NE,     // until ptr == end
+    IR_BOUND_LTU,    // while ptr < end
+    IR_BOUND_COUNT,  // until end, decremented by step, is 0
+};
+
+typedef struct {
+    enum ir_idiom_kind_t kind;
+    enum insn_type_t load;  // type of the loads, or of the store
+    u64 width;              // bytes per element
+    i8 src, dst;            // pointer registers
+    i8 val, val2;           // loaded or stored value registers
+    enum ir_bound_t bound;
+    i8 ptr, end;  // pointer compared against end, a counter is end
+    i64 step;     // counter decrement
+    u64 out;      // strcmp: pc the loop leaves for on a mismatch
+} ir_idiom_t;
+
+typedef struct {
+    enum ir_op_t op;
+    u64 pc;
+    insn_t insn;
+    insn_t jalr;  // jump half of IR_CALL
+    u64 value;    // result of IR_LI
+    u64 nsuccs;
+    u64 succs[2];  // successor pcs inside the region
+    u64 guard;     // jalr: the profiled target it is followed to, or 0
+    bool to_ret;
+    bool to_indirect;
+    bool exit;  // leaves the region
+    u64 latch;  // a loop header's back edge node, 0 if it heads no loop
+    bool counted;  // a loop header whose trips are fixed on the way in
+    i8 iv;         // counted: the register the latch compares and steps
+    i64 iv_step;   // counted: what the loop adds to it on each trip
+    i8 likely;  // branch: 1 if mostly taken, -1 if mostly not, 0 if unknown
+    bool cold;  // only reached through unlikely branch directions
+    i64 sp;     // sp on the way in, relative to sp at the region entry
+    u8 slot;    // promoted stack slot a load or store accesses, plus one
+    ir_idiom_t idiom;  // a loop header's library routine
+    u32 charge;  // instructions charged to the budget on the way in, or 0
+    i64 prefetch;      // load: bytes ahead of its address to prefetch, or 0
+
+    u64 use;    // registers read before being written
+    u64 def;    // registers written
+    u64 dirty;  // registers possibly written on the way in
+    u64 live;   // registers live on the way in
+
+    // guest register values known on the way in
+    bool visited;
+    u32 consts;  // bit i: x<i> is vals[i]
+    u64 vals[num_gp_regs];
+    i8 copies[num_gp_regs];  // x<i> equals x<copies[i]>, or -1
+} ir_insn_t;
+
+typedef struct {
+    u64 ninsns;
+    ir_insn_t insns[IR_MAX_NODES];
+    u64 nrets;
+    u64 ret_pcs[IR_MAX_INSNS];  // return sites of calls inside the region
+    u64 nslots;
+    i64 slots[IR_MAX_SLOTS];  // slot offsets from sp at the region entry
+    u32 slots_stored;         // bit i: slot i is written in the region
+    u64 nentries;
+    u64 entries[IR_MAX_ENTRIES];  // nodes the region can be entered at
+    u64 nextends;
+    u64 extends[IR_MAX_EXTENDS];  // hot exit targets the region takes in
+    u32 consts;  // bit i: the region is specialized on x<i> being vals[i]
+    u64 vals[num_gp_regs];
+} ir_region_t;
+
+void ir_build(ir_region_t *, u64, u64 *, u64);
+u64 ir_find(ir_region_t *, u64);
+void ir_optimize(ir_region_t *);
+void ir_loops(ir_region_t *);
+void ir_slots(ir_region_t *);
+void ir_idioms(ir_region_t *);
+void ir_prefetch(ir_region_t *);
+void ir_layout(ir_region_t *);
+void ir_entries(ir_region_t *);
+void ir_dataflow(ir_region_t *);
+bool ir_const(ir_insn_t *, i8, u64 *);
+
 /**
  * machine.c
  */
@@ -351,12 +583,81 @@ inline void machine_set_gp_reg(machine_t *m, i32 reg, u64 data) {
 
 void machine_setup(machine_t *, int, char **);
 enum exit_reason_t machine_step(machine_t *);
+void machine_interrupt(machine_t *);
 void machine_load_program(machine_t *, char *);
 typedef void (*exec_block_func_t)(state_t *);
 void exec_block_interp(state_t *);
 
-str_t machine_genblock(machine_t *m);
-u8 *machine_compile(machine_t *, str_t);
+// directions the interpreter saw a branch go, in a direct-mapped table
+#define INTERP_PROFILE_SIZE 4096
+
+typedef struct {
+    u64 pc;
+    u64 taken;
+    u64 not_taken;
+} branch_profile_t;
+
+branch_profile_t *interp_branch_profile(u64);
+
+// the target an indirect jump keeps going to, and how often it did not
+typedef struct {
+    u64 pc;
+    u64 target;
+    u64 hits;
+    u64 misses;
+} target_profile_t;
+
+target_profile_t *interp_target_profile(u64);
+
+/* compiled blocks keep these guest registers in host registers, they are
+ * passed as arguments on entry and chaining and spilled to state_t only
+ * when returning to the dispatcher */
+#define JIT_PINNED_REGS {ra, sp, a0, a1}
+#define JIT_NPINNED 4
+
+/* on x86-64 hosts compiled blocks divide by a non-constant divisor with the
+ * bare host instruction, the SIGFPE handler in trap.c supplies the RISC-V
+ * results of x / 0 and INT_MIN / -1 and resumes after the faulting divide */
+#if defined(__x86_64__)
+#define JIT_TRAP_DIV 1
+#else
+#define JIT_TRAP_DIV 0
+#endif
+
+/* trap.c */
+void trap_div_install(u8 *, u64);
+typedef void (*jit_block_func_t)(state_t *, u64, u64, u64, u64);
+
+str_t machine_genblock(machine_t *, u64);
+
+/* compile.c */
+#define JIT_ASYNC 1  // compile regions on background threads
+#define COMPILE_JOBS 64  // regions queued for or in compilation at once
+#define COMPILE_WORKERS 32  // most compiler threads, one per spare host cpu
+
+enum compile_state_t {
+    COMPILE_FREE,
+    COMPILE_QUEUED,
+    COMPILE_RUNNING,
+    COMPILE_DONE,
+};
+
+typedef struct {
+    enum compile_state_t state;
+    u64 pc;
+    u64 epoch;  // cache epoch the source was generated in
+    u64 seq;
+    u64 hotness;  // dispatches to pc so far, the hottest compiles first
+    char *source;
+    u64 len;
+    u8 *object;  // the compiled object, NULL if compiling failed
+    u64 size;
+} compile_job_t;
+
+u8 *machine_compile(machine_t *, u64, str_t);
+bool machine_compile_async(machine_t *, u64, str_t);
+bool machine_compiling(machine_t *, u64);
+void machine_compile_poll(machine_t *);
 
 void insn_decode(insn_t *, u32);
 
@@ -56,7 +56,7 @@ static void func_sltiu(state_t *state, insn_t *insn) {
     FUNC((u64)rs1 < (u64)imm);
 }
 
-static void func_xori(state_t *state, insn_t *insn) { FUNC(rs1 & imm); }
+static void func_xori(state_t *state, insn_t *insn) { FUNC(rs1 ^ imm); }
 
 static void func_srli(state_t *state, insn_t *insn) {
     FUNC(rs1 >> (imm & 0x3f));
@@ -245,12 +245,61 @@ static void func_lui(state_t *state, insn_t *insn) {
     state->gp_regs[insn->rd] = (i64)insn->imm;
 }
 
+static branch_profile_t profiles[INTERP_PROFILE_SIZE];
+
+#define INTERP_PROFILE_INDEX(pc) (((pc) >> 1) & (INTERP_PROFILE_SIZE - 1))
+
+/* count a branch direction, a colliding branch takes the entry over */
+static void interp_profile(u64 pc, bool taken) {
+    branch_profile_t *p = &profiles[INTERP_PROFILE_INDEX(pc)];
+    if (p->pc != pc) {
+        p->pc = pc;
+        p->taken = p->not_taken = 0;
+    }
+    if (taken)
+        p->taken++;
+    else
+        p->not_taken++;
+}
+
+branch_profile_t *interp_branch_profile(u64 pc) {
+    branch_profile_t *p = &profiles[INTERP_PROFILE_INDEX(pc)];
+    return p->pc == pc ? p : NULL;
+}
+
+static target_profile_t targets[INTERP_PROFILE_SIZE];
+
+/* count an indirect jump target, a target seen more often than the one
+ * recorded replaces it */
+static void interp_target(u64 pc, u64 target) {
+    target_profile_t *p = &targets[INTERP_PROFILE_INDEX(pc)];
+    if (p->pc != pc) {
+        p->pc = pc;
+        p->target = target;
+        p->hits = p->misses = 0;
+    }
+    if (p->target == target) {
+        p->hits++;
+    } else if (++p->misses > p->hits) {
+        p->target = target;
+        p->hits = 1;
+        p->misses = 0;
+    }
+}
+
+target_profile_t *interp_target_profile(u64 pc) {
+    target_profile_t *p = &targets[INTERP_PROFILE_INDEX(pc)];
+    return p->pc == pc ? p : NULL;
+}
+
 #define FUNC(expr)                                       \
     {                                                    \
         u64 rs1 = state->gp_regs[insn->rs1];             \
         u64 rs2 = state->gp_regs[insn->rs2];             \
         u64 target_addr = state->pc + (i64)insn->imm;    \
-        if (expr) {                                      \
+        bool taken = (expr);                             \
+        interp_profile(state->pc, taken);                \
+        if (taken) {                                     \
             state->reenter_pc = state->pc = target_addr; \
             state->exit_reason = DIRECT_JMP;             \
             insn->continu = true;                        \
@@ -288,6 +337,7 @@ static void func_jalr(state_t *state, insn_t *insn) {
     state->gp_regs[insn->rd] = state->pc + (insn->rvc ? 2 : 4);
     state->exit_reason = INDIRECT_JMP;
     state->reenter_pc = (rs1 + (i64)insn->imm) & ~(u64)1;
+    interp_target(state->pc, state->reenter_pc);
 }
 
 static void func_jal(state_t *state, insn_t *insn) {
@@ -349,19 +399,19 @@ static void func_fsd(state_t *state, insn_t *insn) { FUNC(u64); }
     state->fp_regs[insn->rd].f = (f32)(expr);
 
 static void func_fmadd_s(state_t *state, insn_t *insn) {
-    FUNC(rs1 * rs2 + rs3);
+    FUNC(fmaf(rs1, rs2, rs3));
 }
 
 static void func_fmsub_s(state_t *state, insn_t *insn) {
-    FUNC(rs1 * rs2 - rs3);
+    FUNC(fmaf(rs1, rs2, -rs3));
 }
 
 static void func_fnmsub_s(state_t *state, insn_t *insn) {
-    FUNC(-(rs1 * rs2) + rs3);
+    FUNC(fmaf(-rs1, rs2, rs3));
 }
 
 static void func_fnmadd_s(state_t *state, insn_t *insn) {
-    FUNC(-(rs1 * rs2) - rs3);
+    FUNC(fmaf(-rs1, rs2, -rs3));
 }
 
 #undef FUNC
@@ -373,16 +423,16 @@ static void func_fnmadd_s(state_t *state, insn_t *insn) {
     state->fp_regs[insn->rd].d = (expr);
 
 static void func_fmadd_d(state_t *state, insn_t *insn) {
-    FUNC(rs1 * rs2 + rs3);
+    FUNC(fma(rs1, rs2, rs3));
 }
 static void func_fmsub_d(state_t *state, insn_t *insn) {
-    FUNC(rs1 * rs2 - rs3);
+    FUNC(fma(rs1, rs2, -rs3));
 }
 static void func_fnmsub_d(state_t *state, insn_t *insn) {
-    FUNC(-(rs1 * rs2) + rs3);
+    FUNC(fma(-rs1, rs2, rs3));
 }
 static void func_fnmadd_d(state_t *state, insn_t *insn) {
-    FUNC(-(rs1 * rs2) - rs3);
+    FUNC(fma(-rs1, rs2, -rs3));
 }
 
 #undef FUNC
@@ -632,6 +682,7 @@ void exec_block_interp(state_t *state) {
         // 执行
         funcs[insn.type](state, &insn);
         state->gp_regs[zero] = 0;  // 每次执行后将zero置为0
+        state->budget--;
 
         if (insn.continu) break;
 
@@ -0,0 +1,1336 @@
+#include "emulator.h"
+
+/*
+ * region IR: the instructions of a region with their control flow graph,
+ * built before any code is generated so that optimizations can run over
+ * guest registers independent of the backend that lowers them.
+ */
+
+enum { N, G, F };  // operand is unused, a gp register or a fp register
+
+typedef struct {
+    u8 rd, rs1, rs2, rs3;
+    bool pure;  // only writes rd, safe to drop when rd is dead
+} ir_operands_t;
+
+#define LOAD {G, G, N, N, false}
+#define STORE {N, G, G, N, false}
+#define ALU_I {G, G, N, N, true}
+#define ALU_R {G, G, G, N, true}
+#define BRANCH {N, G, G, N, false}
+#define FLOAD {F, G, N, N, false}
+#define FSTORE {N, G, F, N, false}
+#define FP_R4 {F, F, F, F, true}
+#define FP_R {F, F, F, N, true}
+#define FP_R1 {F, F, N, N, true}
+#define FP_CMP {G, F, F, N, true}
+#define FP_TO_GP {G, F, N, N, true}
+#define GP_TO_FP {F, G, N, N, true}
+
+static const ir_operands_t operands[nums_insns] = {
+    [insn_lb] = LOAD, [insn_lh] = LOAD, [insn_lw] = LOAD, [insn_ld] = LOAD,
+    [insn_lbu] = LOAD, [insn_lhu] = LOAD, [insn_lwu] = LOAD,
+    [insn_fence] = {N, N, N, N, false}, [insn_fence_i] = {N, N, N, N, false},
+    [insn_addi] = ALU_I, [insn_slli] = ALU_I, [insn_slti] = ALU_I,
+    [insn_sltiu] = ALU_I, [insn_xori] = ALU_I, [insn_srli] = ALU_I,
+    [insn_srai] = ALU_I, [insn_ori] = ALU_I, [insn_andi] = ALU_I,
+    [insn_auipc] = {G, N, N, N, true}, [insn_addiw] = ALU_I,
+    [insn_slliw] = ALU_I, [insn_srliw] = ALU_I, [insn_sraiw] = ALU_I,
+    [insn_sb] = STORE, [insn_sh] = STORE, [insn_sw] = STORE, [insn_sd] = STORE,
+    [insn_add] = ALU_R, [insn_sll] = ALU_R, [insn_slt] = ALU_R,
+    [insn_sltu] = ALU_R, [insn_xor] = ALU_R, [insn_srl] = ALU_R,
+    [insn_or] = ALU_R, [insn_and] = ALU_R, [insn_mul] = ALU_R,
+    [insn_mulh] = ALU_R, [insn_mulhsu] = ALU_R, [insn_mulhu] = ALU_R,
+    [insn_div] = ALU_R, [insn_divu] = ALU_R, [insn_rem] = ALU_R,
+    [insn_remu] = ALU_R, [insn_sub] = ALU_R, [insn_sra] = ALU_R,
+    [insn_lui] = {G, N, N, N, true}, [insn_addw] = ALU_R, [insn_sllw] = ALU_R,
+    [insn_srlw] = ALU_R, [insn_mulw] = ALU_R, [insn_divw] = ALU_R,
+    [insn_divuw] = ALU_R, [insn_remw] = ALU_R, [insn_remuw] = ALU_R,
+    [insn_subw] = ALU_R, [insn_sraw] = ALU_R, [insn_beq] = BRANCH,
+    [insn_bne] = BRANCH, [insn_blt] = BRANCH, [insn_bge] = BRANCH,
+    [insn_bltu] = BRANCH, [insn_bgeu] = BRANCH,
+    [insn_jalr] = {G, G, N, N, false}, [insn_jal] = {G, N, N, N, false},
+    [insn_ecall] = {N, N, N, N, false}, [insn_csrrc] = {G, N, N, N, false},
+    [insn_csrrci] = {G, N, N, N, false}, [insn_csrrs] = {G, N, N, N, false},
+    [insn_csrrsi] = {G, N, N, N, false}, [insn_csrrw] = {G, N, N, N, false},
+    [insn_csrrwi] = {G, N, N, N, false}, [insn_flw] = FLOAD,
+    [insn_fsw] = FSTORE, [insn_fmadd_s] = FP_R4, [insn_fmsub_s] = FP_R4,
+    [insn_fnmsub_s] = FP_R4, [insn_fnmadd_s] = FP_R4, [insn_fadd_s] = FP_R,
+    [insn_fsub_s] = FP_R, [insn_fmul_s] = FP_R, [insn_fdiv_s] = FP_R,
+    [insn_fsqrt_s] = FP_R1, [insn_fsgnj_s] = FP_R, [insn_fsgnjn_s] = FP_R,
+    [insn_fsgnjx_s] = FP_R, [insn_fmin_s] = FP_R, [insn_fmax_s] = FP_R,
+    [insn_fcvt_w_s] = FP_TO_GP, [insn_fcvt_wu_s] = FP_TO_GP,
+    [insn_fmv_x_w] = FP_TO_GP, [insn_feq_s] = FP_CMP, [insn_flt_s] = FP_CMP,
+    [insn_fle_s] = FP_CMP, [insn_fclass_s] = FP_TO_GP,
+    [insn_fcvt_s_w] = GP_TO_FP, [insn_fcvt_s_wu] = GP_TO_FP,
+    [insn_fmv_w_x] = GP_TO_FP, [insn_fcvt_l_s] = FP_TO_GP,
+    [insn_fcvt_lu_s] = FP_TO_GP, [insn_fcvt_s_l] = GP_TO_FP,
+    [insn_fcvt_s_lu] = GP_TO_FP, [insn_fld] = FLOAD, [insn_fsd] = FSTORE,
+    [insn_fmadd_d] = FP_R4, [insn_fmsub_d] = FP_R4, [insn_fnmsub_d] = FP_R4,
+    [insn_fnmadd_d] = FP_R4, [insn_fadd_d] = FP_R, [insn_fsub_d] = FP_R,
+    [insn_fmul_d] = FP_R, [insn_fdiv_d] = FP_R, [insn_fsqrt_d] = FP_R1,
+    [insn_fsgnj_d] = FP_R, [insn_fsgnjn_d] = FP_R, [insn_fsgnjx_d] = FP_R,
+    [insn_fmin_d] = FP_R, [insn_fmax_d] = FP_R, [insn_fcvt_s_d] = FP_R1,
+    [insn_fcvt_d_s] = FP_R1, [insn_feq_d] = FP_CMP, [insn_flt_d] = FP_CMP,
+    [insn_fle_d] = FP_CMP, [insn_fclass_d] = FP_TO_GP,
+    [insn_fcvt_w_d] = FP_TO_GP, [insn_fcvt_wu_d] = FP_TO_GP,
+    [insn_fcvt_d_w] = GP_TO_FP, [insn_fcvt_d_wu] = GP_TO_FP,
+    [insn_fcvt_l_d] = FP_TO_GP, [insn_fcvt_lu_d] = FP_TO_GP,
+    [insn_fmv_x_d] = FP_TO_GP, [insn_fcvt_d_l] = GP_TO_FP,
+    [insn_fcvt_d_lu] = GP_TO_FP, [insn_fmv_d_x] = GP_TO_FP,
+};
+
+#undef LOAD
+#undef STORE
+#undef ALU_I
+#undef ALU_R
+#undef BRANCH
+#undef FLOAD
+#undef FSTORE
+#undef FP_R4
+#undef FP_R
+#undef FP_R1
+#undef FP_CMP
+#undef FP_TO_GP
+#undef GP_TO_FP
+
+static u64 ir_reg(u8 kind, i8 reg) {
+    if (kind == G) return reg == zero ? 0 : GP_REG(reg);
+    if (kind == F) return FP_REG(reg);
+    return 0;
+}
+
+/* registers an instruction reads and writes */
+static void ir_regs(ir_insn_t *ir, u64 *use, u64 *def) {
+    const ir_operands_t *o = &operands[ir->insn.type];
+    *use = 0;
+    *def = 0;
+
+    switch (ir->op) {
+        case IR_INSN:
+            *use = ir_reg(o->rs1, ir->insn.rs1) | ir_reg(o->rs2, ir->insn.rs2) |
+                   ir_reg(o->rs3, ir->insn.rs3);
+            *def = ir_reg(o->rd, ir->insn.rd);
+            break;
+        case IR_CALL:
+            *def = ir_reg(G, ir->insn.rd) | ir_reg(G, ir->jalr.rd);
+            break;
+        case IR_LI:
+            *def = ir_reg(G, ir->insn.rd);
+            break;
+        case IR_NOP:
+        case IR_EXIT:
+            break;
+    }
+}
+
+static ir_insn_t *ir_add(ir_region_t *r, enum ir_op_t op, u64 pc) {
+    assert(r->ninsns < IR_MAX_NODES);
+    ir_insn_t *ir = &r->insns[r->ninsns++];
+    memset(ir, 0, sizeof(ir_insn_t));
+    ir->op = op;
+    ir->pc = pc;
+    return ir;
+}
+
+static void ir_push(ir_insn_t *ir, stack_t *stack, u64 pc) {
+    assert(ir->nsuccs < 2);
+    ir->succs[ir->nsuccs++] = pc;
+    stack_push(stack, pc);
+}
+
+static void ir_add_ret(ir_region_t *r, ir_insn_t *ir, stack_t *stack,
+                       u64 pc) {
+    for (u64 i = 0; i < r->nrets; i++) {
+        if (r->ret_pcs[i] == pc) goto found;
+    }
+    assert(r->nrets < IR_MAX_INSNS);
+    r->ret_pcs[r->nrets++] = pc;
+found:
+    ir_push(ir, stack, pc);
+}
+
+u64 ir_find(ir_region_t *r, u64 pc) {
+    for (u64 i = IR_NODE_ENTRY; i < r->ninsns; i++) {
+        if (r->insns[i].pc == pc) return i;
+    }
+    Fatal("successor is not in the region");
+}
+
+// samples a branch or an indirect jump needs, and the share of them one
+// direction or target needs, to count as biased
+#define IR_PROFILE_MIN 16
+#define IR_PROFILE_BIAS 10
+
+/* the target the interpreter saw an indirect jump at pc nearly always take */
+static u64 ir_guess_target(u64 pc) {
+    target_profile_t *p = interp_target_profile(pc);
+    if (p == NULL || p->hits + p->misses < IR_PROFILE_MIN) return 0;
+    return p->misses * IR_PROFILE_BIAS <= p->hits ? p->target : 0;
+}
+
+static bool ir_is_extend(ir_region_t *r, u64 pc) {
+    for (u64 k = 0; k < r->nextends; k++) {
+        if (r->extends[k] == pc) return true;
+    }
+    return false;
+}
+
+/*
+ * walk the guest code reachable from pc into a region. the hot exit targets
+ * in extends are walked too, past the size limit if it ran out before them
+ */
+void ir_build(ir_region_t *r, u64 pc, u64 *extends, u64 nextends) {
+    static stack_t stack = {0};
+    stack_reset(&stack);
+
+    static set_t set;
+    set_reset(&set);
+
+    r->ninsns = 0;
+    r->nrets = 0;
+    r->nextends = nextends;
+    memcpy(r->extends, extends, nextends * sizeof(u64));
+    r->consts = 0;
+    ir_add(r, IR_NOP, 0)->exit = true;  // IR_NODE_RET
+    ir_add(r, IR_NOP, 0)->exit = true;  // IR_NODE_INDIRECT
+    r->insns[IR_NODE_RET].to_indirect = true;
+
+    u64 ninsns = 0, limit = IR_REGION_INSNS;
+    for (u64 k = 0; k < nextends; k++) stack_push(&stack, extends[k]);
+    stack_push(&stack, pc);
+
+    while (stack_pop(&stack, &pc)) {
+        if (!set_add(&set, pc)) continue;
+
+        if (ninsns >= limit && ir_is_extend(r, pc))
+            limit = ninsns + IR_EXTEND_INSNS;
+        if (ninsns++ >= limit) {
+            ir_add(r, IR_EXIT, pc)->exit = true;
+            continue;
+        }
+
+        ir_insn_t *ir = ir_add(r, IR_INSN, pc);
+        insn_t *insn = &ir->insn;
+        insn_decode(insn, *(u32 *)TO_HOST(pc));
+        u64 next_pc = pc + (insn->rvc ? 2 : 4);
+
+        if (insn->type == insn_auipc && insn->rd != zero) {
+            insn_decode(&ir->jalr, *(u32 *)TO_HOST(pc + 4));
+            if (ir->jalr.type == insn_jalr && ir->jalr.rs1 == insn->rd) {
+                ir->op = IR_CALL;
+                if (ir->jalr.rd == ra)
+                    ir_add_ret(r, ir, &stack,
+                               pc + 4 + (ir->jalr.rvc ? 2 : 4));
+                ir_push(ir, &stack,
+                        (pc + (i64)insn->imm + (i64)ir->jalr.imm) & ~(u64)1);
+                continue;
+            }
+        }
+
+        switch (insn->type) {
+            case insn_beq:
+            case insn_bne:
+            case insn_blt:
+            case insn_bge:
+            case insn_bltu:
+            case insn_bgeu:
+                ir_push(ir, &stack, pc + (i64)insn->imm);
+                ir_push(ir, &stack, next_pc);
+                break;
+            case insn_jal:
+                if (insn->rd == ra) ir_add_ret(r, ir, &stack, next_pc);
+                ir_push(ir, &stack, pc + (i64)insn->imm);
+                break;
+            case insn_jalr:
+                if (insn->rd == ra) ir_add_ret(r, ir, &stack, next_pc);
+                if (insn->rd == zero && insn->rs1 == ra && insn->imm == 0) {
+                    ir->to_ret = true;
+                    break;
+                }
+                // follow the dominant target, a guard leaves for the rest
+                ir->to_indirect = true;
+                ir->guard = ir_guess_target(pc);
+                if (ir->guard != 0) ir_push(ir, &stack, ir->guard);
+                break;
+            case insn_ecall:
+                ir->exit = true;
+                break;
+            default:
+                assert(!insn->continu);
+                ir_push(ir, &stack, next_pc);
+        }
+    }
+
+    for (u64 i = 0; i < r->ninsns; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        ir_regs(ir, &ir->use, &ir->def);
+    }
+}
+
+/* edges of the region's control flow graph, by node index */
+static u64 edges_from[4 * IR_MAX_NODES], edges_to[4 * IR_MAX_NODES];
+static u64 nedges;
+
+static void ir_edges(ir_region_t *r) {
+    nedges = 0;
+
+#define EDGE(a, b)                         \
+    {                                      \
+        assert(nedges < 4 * IR_MAX_NODES); \
+        edges_from[nedges] = (a);          \
+        edges_to[nedges++] = (b);          \
+    }
+
+    for (u64 i = 0; i < r->ninsns; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        for (u64 j = 0; j < ir->nsuccs; j++)
+            EDGE(i, ir_find(r, ir->succs[j]));
+        if (ir->to_ret) EDGE(i, IR_NODE_RET);
+        if (ir->to_indirect) EDGE(i, IR_NODE_INDIRECT);
+    }
+    for (u64 i = 0; i < r->nrets; i++)
+        EDGE(IR_NODE_RET, ir_find(r, r->ret_pcs[i]));
+    for (u64 k = 0; k < r->nextends; k++)
+        EDGE(IR_NODE_INDIRECT, ir_find(r, r->extends[k]));
+
+#undef EDGE
+}
+
+/* evaluate an instruction whose gp operands are known */
+static bool ir_eval(ir_insn_t *ir, u64 rs1, u64 rs2, u64 *out) {
+    insn_t *insn = &ir->insn;
+    i64 imm = (i64)insn->imm;
+
+    switch (insn->type) {
+        case insn_addi:
+            *out = rs1 + imm;
+            break;
+        case insn_slli:
+            *out = rs1 << (imm & 0x3f);
+            break;
+        case insn_slti:
+            *out = (i64)rs1 < imm;
+            break;
+        case insn_sltiu:
+            *out = rs1 < (u64)imm;
+            break;
+        case insn_xori:
+            *out = rs1 ^ imm;
+            break;
+        case insn_srli:
+            *out = rs1 >> (imm & 0x3f);
+            break;
+        case insn_srai:
+            *out = (i64)rs1 >> (imm & 0x3f);
+            break;
+        case insn_ori:
+            *out = rs1 | (u64)imm;
+            break;
+        case insn_andi:
+            *out = rs1 & (u64)imm;
+            break;
+        case insn_auipc:
+            *out = ir->pc + imm;
+            break;
+        case insn_addiw:
+            *out = (i64)(i32)(rs1 + imm);
+            break;
+        case insn_slliw:
+            *out = (i64)(i32)(rs1 << (imm & 0x1f));
+            break;
+        case insn_srliw:
+            *out = (i64)(i32)((u32)rs1 >> (imm & 0x1f));
+            break;
+        case insn_sraiw:
+            *out = (i64)((i32)rs1 >> (imm & 0x1f));
+            break;
+        case insn_add:
+            *out = rs1 + rs2;
+            break;
+        case insn_sll:
+            *out = rs1 << (rs2 & 0x3f);
+            break;
+        case insn_slt:
+            *out = (i64)rs1 < (i64)rs2;
+            break;
+        case insn_sltu:
+            *out = rs1 < rs2;
+            break;
+        case insn_xor:
+            *out = rs1 ^ rs2;
+            break;
+        case insn_srl:
+            *out = rs1 >> (rs2 & 0x3f);
+            break;
+        case insn_or:
+            *out = rs1 | rs2;
+            break;
+        case insn_and:
+            *out = rs1 & rs2;
+            break;
+        case insn_mul:
+            *out = rs1 * rs2;
+            break;
+        case insn_sub:
+            *out = rs1 - rs2;
+            break;
+        case insn_sra:
+            *out = (i64)rs1 >> (rs2 & 0x3f);
+            break;
+        case insn_lui:
+            *out = imm;
+            break;
+        case insn_addw:
+            *out = (i64)(i32)(rs1 + rs2);
+            break;
+        case insn_sllw:
+            *out = (i64)(i32)(rs1 << (rs2 & 0x1f));
+            break;
+        case insn_srlw:
+            *out = (i64)(i32)((u32)rs1 >> (rs2 & 0x1f));
+            break;
+        case insn_mulw:
+            *out = (i64)(i32)(rs1 * rs2);
+            break;
+        case insn_subw:
+            *out = (i64)(i32)(rs1 - rs2);
+            break;
+        case insn_sraw:
+            *out = (i64)(i32)((i32)rs1 >> (rs2 & 0x1f));
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+/* the register rd becomes a plain copy of, or -1 */
+static i8 ir_copy_of(insn_t *insn) {
+    switch (insn->type) {
+        case insn_addi:
+        case insn_ori:
+        case insn_xori:
+            return insn->imm == 0 ? insn->rs1 : -1;
+        case insn_add:
+        case insn_or:
+        case insn_xor:
+            if (insn->rs2 == zero) return insn->rs1;
+            if (insn->rs1 == zero) return insn->rs2;
+            return -1;
+        case insn_sub:
+            return insn->rs2 == zero ? insn->rs1 : -1;
+        default:
+            return -1;
+    }
+}
+
+bool ir_const(ir_insn_t *ir, i8 reg, u64 *val) {
+    if (reg == zero) {
+        *val = 0;
+        return true;
+    }
+    if (!(ir->consts & (1U << reg))) return false;
+    *val = ir->vals[reg];
+    return true;
+}
+
+/* value of a gp source operand, unused operands read as 0 */
+static bool ir_operand(ir_insn_t *ir, u8 kind, i8 reg, u64 *val) {
+    if (kind != G) {
+        *val = 0;
+        return true;
+    }
+    return ir_const(ir, reg, val);
+}
+
+/* fold an instruction whose gp operands are all known */
+static bool ir_fold(ir_insn_t *ir, u64 *val) {
+    const ir_operands_t *o = &operands[ir->insn.type];
+    u64 rs1, rs2;
+    return o->pure && o->rd == G &&
+           ir_operand(ir, o->rs1, ir->insn.rs1, &rs1) &&
+           ir_operand(ir, o->rs2, ir->insn.rs2, &rs2) &&
+           ir_eval(ir, rs1, rs2, val);
+}
+
+typedef struct {
+    u32 consts;
+    u64 vals[num_gp_regs];
+    i8 copies[num_gp_regs];
+} ir_values_t;
+
+static void ir_kill(ir_values_t *v, i8 reg) {
+    v->consts &= ~(1U << reg);
+    v->copies[reg] = -1;
+    for (int i = 0; i < num_gp_regs; i++) {
+        if (v->copies[i] == reg) v->copies[i] = -1;
+    }
+}
+
+static void ir_set_const(ir_values_t *v, i8 reg, u64 val) {
+    if (reg == zero) return;
+    ir_kill(v, reg);
+    v->consts |= 1U << reg;
+    v->vals[reg] = val;
+}
+
+/* register values after the instruction, from the ones before it */
+static void ir_transfer(ir_insn_t *ir, ir_values_t *v) {
+    v->consts = ir->consts;
+    memcpy(v->vals, ir->vals, sizeof(v->vals));
+    memcpy(v->copies, ir->copies, sizeof(v->copies));
+
+    insn_t *insn = &ir->insn;
+    switch (ir->op) {
+        case IR_CALL:
+            ir_set_const(v, insn->rd, ir->pc + (i64)insn->imm);
+            ir_set_const(v, ir->jalr.rd, ir->pc + 4 + (ir->jalr.rvc ? 2 : 4));
+            return;
+        case IR_LI:
+            ir_set_const(v, insn->rd, ir->value);
+            return;
+        case IR_NOP:
+        case IR_EXIT:
+            return;
+        case IR_INSN:
+            break;
+    }
+
+    for (int i = 1; i < num_gp_regs; i++) {
+        if (ir->def & GP_REG(i)) ir_kill(v, i);
+    }
+
+    u64 val;
+    if (operands[insn->type].rd != G || insn->rd == zero) return;
+
+    if (insn->type == insn_jal || insn->type == insn_jalr) {
+        ir_set_const(v, insn->rd, ir->pc + (insn->rvc ? 2 : 4));
+    } else if (ir_fold(ir, &val)) {
+        ir_set_const(v, insn->rd, val);
+    } else {
+        i8 src = ir_copy_of(insn);
+        if (src > zero && src != insn->rd) {
+            if (ir->copies[src] >= 0) src = ir->copies[src];
+            v->copies[insn->rd] = src;
+        }
+    }
+}
+
+/* meet the values flowing along an edge into a node */
+static bool ir_meet(ir_insn_t *ir, ir_values_t *v) {
+    if (!ir->visited) {
+        ir->visited = true;
+        ir->consts = v->consts;
+        memcpy(ir->vals, v->vals, sizeof(ir->vals));
+        memcpy(ir->copies, v->copies, sizeof(ir->copies));
+        return true;
+    }
+
+    bool changed = false;
+    for (int i = 0; i < num_gp_regs; i++) {
+        if ((ir->consts & (1U << i)) &&
+            (!(v->consts & (1U << i)) || v->vals[i] != ir->vals[i])) {
+            ir->consts &= ~(1U << i);
+            changed = true;
+        }
+        if (ir->copies[i] >= 0 && ir->copies[i] != v->copies[i]) {
+            ir->copies[i] = -1;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/* constant and copy propagation over gp registers */
+static void ir_propagate(ir_region_t *r) {
+    for (u64 i = 0; i < r->ninsns; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        ir->visited = false;
+        ir->consts = 0;
+        memset(ir->copies, -1, sizeof(ir->copies));
+    }
+    r->insns[IR_NODE_ENTRY].visited = true;
+    r->insns[IR_NODE_ENTRY].consts = r->consts;
+    memcpy(r->insns[IR_NODE_ENTRY].vals, r->vals, sizeof(r->vals));
+
+    static ir_values_t v;
+    bool changed;
+    do {
+        changed = false;
+        for (u64 i = 0; i < nedges; i++) {
+            ir_insn_t *from = &r->insns[edges_from[i]];
+            ir_insn_t *to = &r->insns[edges_to[i]];
+            if (!from->visited) continue;
+            ir_transfer(from, &v);
+            if (ir_meet(to, &v)) changed = true;
+        }
+    } while (changed);
+
+    for (u64 i = IR_NODE_ENTRY; i < r->ninsns; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        insn_t *insn = &ir->insn;
+        if (ir->op != IR_INSN) continue;
+
+        const ir_operands_t *o = &operands[insn->type];
+        u64 val;
+        if (ir_fold(ir, &val)) {
+            ir->op = IR_LI;
+            ir->value = val;
+            continue;
+        }
+
+        if (o->rs1 == G && ir->copies[insn->rs1] >= 0 &&
+            !ir_const(ir, insn->rs1, &val))
+            insn->rs1 = ir->copies[insn->rs1];
+        if (o->rs2 == G && ir->copies[insn->rs2] >= 0 &&
+            !ir_const(ir, insn->rs2, &val))
+            insn->rs2 = ir->copies[insn->rs2];
+    }
+
+    for (u64 i = 0; i < r->ninsns; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        ir_regs(ir, &ir->use, &ir->def);
+    }
+}
+
+/*
+ * charge the budget where every cycle through the region passes: a back
+ * edge's target is charged the nodes of the loop it closes, and an exit the
+ * longest path to it from the entry, edges come out in node order
+ */
+static void ir_charges(ir_region_t *r) {
+    static u32 depth[IR_MAX_NODES];
+
+    memset(depth, 0, sizeof(u32) * r->ninsns);
+    depth[IR_NODE_ENTRY] = 1;
+    for (u64 i = 0; i < r->ninsns; i++) r->insns[i].charge = 0;
+
+    for (u64 i = 0; i < nedges; i++) {
+        u64 from = edges_from[i], to = edges_to[i];
+        if (from < IR_NODE_ENTRY || to < IR_NODE_ENTRY) continue;
+        ir_insn_t *ir = &r->insns[to];
+        if (from >= to) {
+            ir->charge = MAX(ir->charge, (u32)(from - to + 1));
+        } else if (depth[from] != 0) {
+            depth[to] = MAX(depth[to], depth[from] + 1U);
+        }
+    }
+    for (u64 i = IR_NODE_ENTRY; i < r->ninsns; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        if (ir->op == IR_EXIT) ir->charge = MAX(ir->charge, MAX(depth[i], 1U));
+    }
+}
+
+/* drop pure writes that are overwritten before any exit reads them */
+static void ir_eliminate(ir_region_t *r) {
+    bool removed;
+    do {
+        for (u64 i = 0; i < r->ninsns; i++) {
+            ir_insn_t *ir = &r->insns[i];
+            // the budget can run out at a charged node before it runs
+            ir->live = ir->use | (ir->exit ? ~ir->def : 0) |
+                       (ir->charge ? ~0ULL : 0);
+        }
+
+        bool changed;
+        do {
+            changed = false;
+            for (u64 i = nedges; i-- > 0;) {
+                ir_insn_t *from = &r->insns[edges_from[i]];
+                u64 live = r->insns[edges_to[i]].live & ~from->def;
+                if (live & ~from->live) {
+                    from->live |= live;
+                    changed = true;
+                }
+            }
+        } while (changed);
+
+        removed = false;
+        for (u64 i = IR_NODE_ENTRY; i < r->ninsns; i++) {
+            ir_insn_t *ir = &r->insns[i];
+            bool pure = ir->op == IR_LI ||
+                        (ir->op == IR_INSN && operands[ir->insn.type].pure);
+            if (ir->exit || !pure) continue;
+
+            u64 out = 0;
+            for (u64 j = 0; j < nedges; j++) {
+                if (edges_from[j] == i) out |= r->insns[edges_to[j]].live;
+            }
+            if (ir->def & out) continue;
+
+            ir->op = IR_NOP;
+            ir_regs(ir, &ir->use, &ir->def);
+            removed = true;
+        }
+    } while (removed);
+}
+
+void ir_optimize(ir_region_t *r) {
+    ir_edges(r);
+    ir_propagate(r);
+    ir_charges(r);
+    ir_eliminate(r);
+}
+
+static bool ir_is_branch(insn_t *insn) {
+    return insn->type >= insn_beq && insn->type <= insn_bgeu;
+}
+
+/* addi reg, reg, imm */
+static bool ir_is_step(ir_insn_t *ir, i8 *reg, i64 *imm) {
+    insn_t *insn = &ir->insn;
+    if (ir->op != IR_INSN || insn->type != insn_addi || insn->rd == zero ||
+        insn->rd != insn->rs1)
+        return false;
+    *reg = insn->rd;
+    *imm = (i64)insn->imm;
+    return true;
+}
+
+/* addi or add of a known value moving a register by a fixed step */
+static bool ir_is_stride(ir_insn_t *ir, i8 *reg, i64 *step) {
+    insn_t *insn = &ir->insn;
+    u64 val;
+    if (ir_is_step(ir, reg, step)) return true;
+    if (ir->op != IR_INSN || insn->type != insn_add || insn->rd == zero)
+        return false;
+    *reg = insn->rd;
+    if (insn->rs1 == insn->rd && ir_const(ir, insn->rs2, &val)) {
+        *step = (i64)val;
+        return true;
+    }
+    if (insn->rs2 == insn->rd && ir_const(ir, insn->rs1, &val)) {
+        *step = (i64)val;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * a loop is counted when its latch compares a register it moves by a fixed
+ * step once per iteration with one it leaves alone, toward where the
+ * compare fails. it then runs a number of trips that is fixed on the way
+ * in, codegen works it out there
+ */
+static bool ir_is_counted(ir_region_t *r, u64 h) {
+    u64 latch = r->insns[h].latch;
+    u64 ndefs[num_gp_regs] = {0};
+    i64 steps[num_gp_regs] = {0};
+    for (u64 i = h; i < latch; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        u64 use, def;
+        i8 reg;
+        i64 step;
+        ir_regs(ir, &use, &def);
+        for (int k = 0; k < num_gp_regs; k++) {
+            if (def & GP_REG(k)) ndefs[k]++;
+        }
+        if (ir_is_stride(ir, &reg, &step)) steps[reg] = step;
+    }
+
+    insn_t *insn = &r->insns[latch].insn;
+    i8 a = insn->rs1, b = insn->rs2, iv;
+    if (ndefs[a] == 1 && steps[a] != 0 && ndefs[b] == 0)
+        iv = a;
+    else if (ndefs[b] == 1 && steps[b] != 0 && ndefs[a] == 0)
+        iv = b;
+    else
+        return false;
+
+    // a < b holds until a rises or b falls past the other, a >= b until a
+    // falls or b rises. stepping the other way only ends by wrapping around
+    bool up = steps[iv] > 0;
+    switch (insn->type) {
+        case insn_bne:
+            break;
+        case insn_blt:
+        case insn_bltu:
+            if (up != (iv == a)) return false;
+            break;
+        case insn_bge:
+        case insn_bgeu:
+            if (up != (iv == b)) return false;
+            break;
+        default:
+            return false;
+    }
+    r->insns[h].iv = iv;
+    r->insns[h].iv_step = steps[iv];
+    return true;
+}
+
+/*
+ * find simple loops: a run of straight-line nodes closed by a conditional
+ * branch back to the first one, entered only through its header
+ */
+void ir_loops(ir_region_t *r) {
+    static u64 npreds[IR_MAX_NODES], pred[IR_MAX_NODES];
+
+    ir_edges(r);
+    memset(npreds, 0, sizeof(u64) * r->ninsns);
+    for (u64 i = 0; i < nedges; i++) {
+        npreds[edges_to[i]]++;
+        pred[edges_to[i]] = edges_from[i];
+    }
+
+    for (u64 h = IR_NODE_ENTRY; h < r->ninsns; h++) {
+        for (u64 i = h; i < r->ninsns; i++) {
+            ir_insn_t *ir = &r->insns[i];
+            if (i > h && (npreds[i] != 1 || pred[i] != i - 1)) break;
+            if (ir->op == IR_EXIT || ir->op == IR_CALL || ir->exit) break;
+            if (ir->op != IR_INSN) continue;
+            if (ir_is_branch(&ir->insn)) {
+                if (ir->succs[0] == r->insns[h].pc) {
+                    r->insns[h].latch = i;
+                    r->insns[h].counted = ir_is_counted(r, h);
+                }
+                break;
+            }
+            if (ir->insn.continu) break;
+        }
+    }
+}
+
+/* bytes a load or store accesses, 0 for any other instruction */
+static u64 ir_access_size(insn_t *insn) {
+    switch (insn->type) {
+        case insn_lb:
+        case insn_lbu:
+        case insn_sb:
+            return 1;
+        case insn_lh:
+        case insn_lhu:
+        case insn_sh:
+            return 2;
+        case insn_lw:
+        case insn_lwu:
+        case insn_sw:
+        case insn_flw:
+        case insn_fsw:
+            return 4;
+        case insn_ld:
+        case insn_sd:
+        case insn_fld:
+        case insn_fsd:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+/* where a call made by the node returns to, 0 if it makes none */
+static u64 ir_ret_pc(ir_insn_t *ir) {
+    if (ir->op == IR_CALL && ir->jalr.rd == ra)
+        return ir->pc + 4 + (ir->jalr.rvc ? 2 : 4);
+    if (ir->op == IR_INSN && ir->insn.rd == ra &&
+        (ir->insn.type == insn_jal || ir->insn.type == insn_jalr))
+        return ir->pc + (ir->insn.rvc ? 2 : 4);
+    return 0;
+}
+
+/* sp after the node from sp before it, false if it is not a known offset */
+static bool ir_sp_transfer(ir_insn_t *ir, i64 *off) {
+    if (!(ir->def & GP_REG(sp))) return true;
+    if (ir->op != IR_INSN || ir->insn.type != insn_addi ||
+        ir->insn.rs1 != sp)
+        return false;
+    *off += (i64)ir->insn.imm;
+    return true;
+}
+
+/* sp is only adjusted by constants and used as a load or store base */
+static bool ir_sp_escapes(ir_insn_t *ir) {
+    insn_t *insn = &ir->insn;
+    if (ir->op != IR_INSN || !(ir->use & GP_REG(sp))) return false;
+    if (insn->type == insn_addi && insn->rd == sp) return false;
+
+    const ir_operands_t *o = &operands[insn->type];
+    if (ir_access_size(insn) == 0 || insn->rs1 != sp) return true;
+    return o->rs2 == G && insn->rs2 == sp;
+}
+
+/*
+ * promote guest stack slots to host locals: when sp stays a known offset
+ * from its value at the entry and never escapes the region, nothing but
+ * sp-relative accesses can reach the frames allocated below it, so their
+ * doubleword slots are loaded once at the entry and stored back at exits.
+ */
+void ir_slots(ir_region_t *r) {
+    r->nslots = 0;
+    r->slots_stored = 0;
+
+    ir_edges(r);
+    for (u64 i = 0; i < r->ninsns; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        ir->visited = false;
+        ir->slot = 0;
+        if (ir_sp_escapes(ir)) return;
+    }
+    r->insns[IR_NODE_ENTRY].visited = true;
+    r->insns[IR_NODE_ENTRY].sp = 0;
+
+    // the pseudo exits need no sp, a call's return site is assumed to see
+    // the sp of the call and the generated code checks it on returning
+    bool changed;
+    do {
+        changed = false;
+        for (u64 i = 0; i < nedges + r->ninsns; i++) {
+            ir_insn_t *from, *to;
+            if (i < nedges) {
+                if (edges_from[i] < IR_NODE_ENTRY ||
+                    edges_to[i] < IR_NODE_ENTRY)
+                    continue;
+                from = &r->insns[edges_from[i]];
+                to = &r->insns[edges_to[i]];
+            } else {
+                from = &r->insns[i - nedges];
+                u64 ret_pc = ir_ret_pc(from);
+                if (ret_pc == 0) continue;
+                to = &r->insns[ir_find(r, ret_pc)];
+            }
+
+            i64 off = from->sp;
+            if (!from->visited) continue;
+            if (!ir_sp_transfer(from, &off)) return;
+            if (!to->visited) {
+                to->visited = true;
+                to->sp = off;
+                changed = true;
+            } else if (to->sp != off) {
+                return;
+            }
+        }
+    } while (changed);
+
+    // code only reached through the indirect exit sees no known sp
+    for (u64 i = IR_NODE_ENTRY; i < r->ninsns; i++) {
+        if (!r->insns[i].visited) return;
+    }
+
+    // doubleword accesses below the entry sp are the candidates
+    for (u64 i = IR_NODE_ENTRY; i < r->ninsns; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        insn_t *insn = &ir->insn;
+        if (ir->op != IR_INSN || ir_access_size(insn) != 8 ||
+            insn->rs1 != sp)
+            continue;
+
+        i64 off = ir->sp + (i64)insn->imm;
+        if (off >= 0 || (off & 7) != 0) continue;
+
+        u64 k = 0;
+        while (k < r->nslots && r->slots[k] != off) k++;
+        if (k == r->nslots && r->nslots < IR_MAX_SLOTS)
+            r->slots[r->nslots++] = off;
+    }
+
+    // a narrower access overlapping a slot has to see it in memory
+    u32 narrow = 0;
+    for (u64 i = IR_NODE_ENTRY; i < r->ninsns; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        insn_t *insn = &ir->insn;
+        i64 size = ir_access_size(insn);
+        if (ir->op != IR_INSN || size == 0 || insn->rs1 != sp) continue;
+
+        i64 off = ir->sp + (i64)insn->imm;
+        for (u64 k = 0; k < r->nslots; k++) {
+            if (off < r->slots[k] + 8 && r->slots[k] < off + size &&
+                (size != 8 || off != r->slots[k]))
+                narrow |= 1U << k;
+        }
+    }
+
+    u64 nslots = 0;
+    for (u64 k = 0; k < r->nslots; k++) {
+        if (!(narrow & (1U << k))) r->slots[nslots++] = r->slots[k];
+    }
+    r->nslots = nslots;
+
+    for (u64 i = IR_NODE_ENTRY; i < r->ninsns; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        insn_t *insn = &ir->insn;
+        if (ir->op != IR_INSN || ir_access_size(insn) != 8 ||
+            insn->rs1 != sp)
+            continue;
+
+        i64 off = ir->sp + (i64)insn->imm;
+        for (u64 k = 0; k < r->nslots; k++) {
+            if (r->slots[k] != off) continue;
+            ir->slot = k + 1;
+            if (operands[insn->type].rd == N) r->slots_stored |= 1U << k;
+        }
+    }
+}
+
+static bool ir_is_load(ir_insn_t *ir) {
+    return ir->op == IR_INSN && operands[ir->insn.type].rd == G &&
+           ir_access_size(&ir->insn) != 0 && ir->insn.imm == 0;
+}
+
+static bool ir_is_store(ir_insn_t *ir) {
+    return ir->op == IR_INSN && operands[ir->insn.type].rs2 == G &&
+           ir_access_size(&ir->insn) != 0 && ir->insn.imm == 0;
+}
+
+/* bne a, b compares reg with the other operand */
+static bool ir_is_bne(insn_t *insn, i8 reg, i8 *other) {
+    if (insn->type != insn_bne || (insn->rs1 != reg && insn->rs2 != reg))
+        return false;
+    *other = insn->rs1 == reg ? insn->rs2 : insn->rs1;
+    return true;
+}
+
+/*
+ * a copy, fill or strlen loop: one load and/or one store at offset 0, the
+ * pointers stepped by the element size after them, maybe a counter, and
+ * a back edge testing a pointer, the counter or the loaded byte
+ */
+static bool ir_match_loop(ir_region_t *r, u64 h, ir_idiom_t *idiom) {
+    ir_insn_t *latch = &r->insns[r->insns[h].latch];
+    ir_insn_t *load = NULL, *store = NULL;
+    i8 steps[3];
+    i64 imms[3];
+    u64 nsteps = 0, load_step = 0, store_step = 0;
+    u64 written = 0;
+
+    for (u64 i = h; i < r->insns[h].latch; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        if (ir->op == IR_NOP) continue;
+        written |= ir->def;
+
+        if (ir_is_load(ir) && load == NULL) {
+            load = ir;
+        } else if (ir_is_store(ir) && store == NULL) {
+            store = ir;
+        } else if (nsteps < 3 && ir_is_step(ir, &steps[nsteps],
+                                            &imms[nsteps])) {
+            // a pointer has to be stepped after its access
+            if (load && steps[nsteps] == load->insn.rs1) load_step = i;
+            if (store && steps[nsteps] == store->insn.rs1) store_step = i;
+            nsteps++;
+        } else {
+            return false;
+        }
+    }
+
+    memset(idiom, 0, sizeof(ir_idiom_t));
+    idiom->src = idiom->dst = idiom->val = idiom->val2 = -1;
+    idiom->ptr = idiom->end = -1;
+    insn_t *branch = &latch->insn;
+    i8 other;
+
+    if (load && !store) {
+        idiom->kind = IR_IDIOM_STRLEN;
+        idiom->load = load->insn.type;
+        idiom->width = 1;
+        idiom->src = load->insn.rs1;
+        idiom->val = load->insn.rd;
+        return idiom->width == ir_access_size(&load->insn) && nsteps == 1 &&
+               load_step && imms[0] == 1 && idiom->val != zero &&
+               idiom->val != idiom->src &&
+               ir_is_bne(branch, idiom->val, &other) && other == zero;
+    }
+
+    if (!store) return false;
+    idiom->width = ir_access_size(&store->insn);
+    idiom->dst = store->insn.rs1;
+    idiom->val = store->insn.rs2;
+    if (!store_step || idiom->val == idiom->dst) return false;
+
+    if (load) {
+        idiom->kind = IR_IDIOM_COPY;
+        idiom->load = load->insn.type;
+        idiom->src = load->insn.rs1;
+        if (load > store || !load_step || load->insn.rd != idiom->val ||
+            ir_access_size(&load->insn) != idiom->width ||
+            idiom->val == zero || idiom->src == idiom->dst ||
+            idiom->val == idiom->src)
+            return false;
+    } else {
+        idiom->kind = IR_IDIOM_FILL;
+        idiom->load = store->insn.type;
+        if (written & GP_REG(idiom->val)) return false;
+    }
+
+    // the steps are the pointers' and at most one counter's
+    for (u64 k = 0; k < nsteps; k++) {
+        if (steps[k] == idiom->src || steps[k] == idiom->dst) {
+            if (imms[k] != (i64)idiom->width) return false;
+        } else if (idiom->end < 0 && imms[k] < 0 && steps[k] != idiom->val) {
+            idiom->bound = IR_BOUND_COUNT;
+            idiom->end = steps[k];
+            idiom->step = -imms[k];
+        } else {
+            return false;
+        }
+    }
+    if (nsteps != (load ? 3 : 2) - (idiom->end < 0)) return false;
+
+    if (idiom->bound == IR_BOUND_COUNT)
+        return ir_is_bne(branch, idiom->end, &other) && other == zero;
+
+    i8 ptrs[2] = {idiom->dst, idiom->src};
+    for (int k = 0; k < 2; k++) {
+        if (ptrs[k] < 0) continue;
+        idiom->ptr = ptrs[k];
+        if (ir_is_bne(branch, ptrs[k], &idiom->end)) {
+            idiom->bound = IR_BOUND_NE;
+        } else if (branch->type == insn_bltu && branch->rs1 == ptrs[k]) {
+            idiom->bound = IR_BOUND_LTU;
+            idiom->end = branch->rs2;
+        } else {
+            continue;
+        }
+        return !(written & GP_REG(idiom->end)) && idiom->end != idiom->val;
+    }
+    return false;
+}
+
+/*
+ * a strcmp loop: two byte loads at offset 0, both pointers stepped by one,
+ * a branch out of the loop when the bytes differ and a back edge while
+ * they are not 0
+ */
+static bool ir_match_strcmp(ir_region_t *r, u64 h, ir_idiom_t *idiom) {
+    if (h + 6 > r->ninsns) return false;
+
+    ir_insn_t *loads[2];
+    u64 nloads = 0;
+    u64 steps = 0;
+    for (u64 i = h; i < h + 4; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        i8 reg;
+        i64 imm;
+        if (ir_is_load(ir) && ir_access_size(&ir->insn) == 1 && nloads < 2) {
+            loads[nloads++] = ir;
+            continue;
+        }
+        if (!ir_is_step(ir, &reg, &imm) || imm != 1) return false;
+        for (u64 k = 0; k < nloads; k++) {
+            if (loads[k]->insn.rs1 == reg) steps |= 1 << k;
+        }
+    }
+    if (nloads != 2 || steps != 3) return false;
+
+    memset(idiom, 0, sizeof(ir_idiom_t));
+    idiom->kind = IR_IDIOM_STRCMP;
+    idiom->load = loads[0]->insn.type;
+    idiom->width = 1;
+    idiom->src = loads[0]->insn.rs1;
+    idiom->dst = loads[1]->insn.rs1;
+    idiom->val = loads[0]->insn.rd;
+    idiom->val2 = loads[1]->insn.rd;
+    idiom->ptr = idiom->end = -1;
+    if (loads[1]->insn.type != idiom->load || idiom->src == idiom->dst ||
+        idiom->val == idiom->val2 || idiom->val == zero ||
+        idiom->val2 == zero || idiom->val == idiom->src ||
+        idiom->val == idiom->dst || idiom->val2 == idiom->src ||
+        idiom->val2 == idiom->dst)
+        return false;
+
+    ir_insn_t *differ = &r->insns[h + 4], *latch = &r->insns[h + 5];
+    i8 other;
+    if (differ->op != IR_INSN || latch->op != IR_INSN ||
+        !ir_is_bne(&differ->insn, idiom->val, &other) ||
+        other != idiom->val2 || differ->succs[0] == r->insns[h].pc)
+        return false;
+    idiom->out = differ->succs[0];
+
+    return (ir_is_bne(&latch->insn, idiom->val, &other) ||
+            ir_is_bne(&latch->insn, idiom->val2, &other)) &&
+           other == zero && latch->succs[0] == r->insns[h].pc;
+}
+
+/* recognize loops a library routine can run in one go */
+void ir_idioms(ir_region_t *r) {
+    static u64 npreds[IR_MAX_NODES], pred[IR_MAX_NODES];
+
+    ir_edges(r);
+    memset(npreds, 0, sizeof(u64) * r->ninsns);
+    for (u64 i = 0; i < nedges; i++) {
+        npreds[edges_to[i]]++;
+        pred[edges_to[i]] = edges_from[i];
+    }
+
+    for (u64 h = IR_NODE_ENTRY; h < r->ninsns; h++) {
+        ir_insn_t *ir = &r->insns[h];
+        ir->idiom.kind = IR_IDIOM_NONE;
+        if (ir->latch != 0) {
+            if (!ir_match_loop(r, h, &ir->idiom))
+                ir->idiom.kind = IR_IDIOM_NONE;
+            continue;
+        }
+
+        bool straight = h + 6 <= r->ninsns;
+        for (u64 i = h + 1; straight && i < h + 6; i++)
+            straight = npreds[i] == 1 && pred[i] == i - 1;
+        if (!straight || !ir_match_strcmp(r, h, &ir->idiom))
+            ir->idiom.kind = IR_IDIOM_NONE;
+    }
+}
+
+// bytes ahead of a strided load its line is prefetched
+#define IR_PREFETCH_BYTES 512
+
+/*
+ * prefetch ahead of the loads in a loop whose base register moves by the
+ * same step every iteration, a few hundred bytes ahead is far enough to
+ * hide a miss but near enough not to outrun short loops
+ */
+void ir_prefetch(ir_region_t *r) {
+    for (u64 i = 0; i < r->ninsns; i++) r->insns[i].prefetch = 0;
+
+    for (u64 h = IR_NODE_ENTRY; h < r->ninsns; h++) {
+        u64 latch = r->insns[h].latch;
+        if (latch == 0) continue;
+
+        u64 ndefs[num_gp_regs] = {0};
+        i64 steps[num_gp_regs] = {0};
+        for (u64 i = h; i <= latch; i++) {
+            ir_insn_t *ir = &r->insns[i];
+            u64 use, def;
+            i8 reg;
+            i64 step;
+            ir_regs(ir, &use, &def);
+            for (int k = 0; k < num_gp_regs; k++) {
+                if (def & GP_REG(k)) ndefs[k]++;
+            }
+            if (ir_is_stride(ir, &reg, &step)) steps[reg] = step;
+        }
+
+        for (u64 i = h; i <= latch; i++) {
+            ir_insn_t *ir = &r->insns[i];
+            if (ir->op != IR_INSN || ir->slot ||
+                ir_access_size(&ir->insn) == 0 ||
+                operands[ir->insn.type].rd == N)
+                continue;
+            i8 base = ir->insn.rs1;
+            i64 step = steps[base];
+            if (ndefs[base] != 1 || step == 0) continue;
+
+            i64 ahead = IR_PREFETCH_BYTES / (step < 0 ? -step : step);
+            ir->prefetch = step * (ahead > 0 ? ahead : 1);
+        }
+    }
+}
+
+/*
+ * mark the directions the interpreter saw a branch take nearly always,
+ * the nodes reached only through the other directions are cold
+ */
+void ir_layout(ir_region_t *r) {
+    static u64 work[IR_MAX_NODES];
+
+    for (u64 i = 0; i < r->ninsns; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        ir->likely = 0;
+        ir->cold = true;
+        if (ir->op != IR_INSN || !ir_is_branch(&ir->insn)) continue;
+
+        branch_profile_t *p = interp_branch_profile(ir->pc);
+        if (p == NULL || p->taken + p->not_taken < IR_PROFILE_MIN) continue;
+        if (p->not_taken * IR_PROFILE_BIAS <= p->taken) ir->likely = 1;
+        if (p->taken * IR_PROFILE_BIAS <= p->not_taken) ir->likely = -1;
+    }
+
+    ir_edges(r);
+    u64 nwork = 0;
+    r->insns[IR_NODE_ENTRY].cold = false;
+    work[nwork++] = IR_NODE_ENTRY;
+
+    while (nwork > 0) {
+        u64 n = work[--nwork];
+        ir_insn_t *from = &r->insns[n];
+        for (u64 i = 0; i < nedges; i++) {
+            ir_insn_t *to = &r->insns[edges_to[i]];
+            if (edges_from[i] != n || !to->cold) continue;
+
+            // succs[0] is the taken side of a branch
+            bool taken = to->pc == from->succs[0];
+            if ((from->likely > 0 && !taken) || (from->likely < 0 && taken))
+                continue;
+            to->cold = false;
+            work[nwork++] = edges_to[i];
+        }
+    }
+}
+
+static void ir_add_entry(ir_region_t *r, u64 node) {
+    ir_insn_t *ir = &r->insns[node];
+
+    // an exit would only chain back to its own entry point
+    if (node == IR_NODE_ENTRY || ir->op == IR_EXIT ||
+        r->nentries == IR_MAX_ENTRIES)
+        return;
+    // values propagated into the node only hold on the region's own paths
+    if (ir->consts != 0) return;
+    for (int i = 0; i < num_gp_regs; i++) {
+        if (ir->copies[i] >= 0) return;
+    }
+    for (u64 k = 0; k < r->nentries; k++) {
+        if (r->entries[k] == node) return;
+    }
+    r->entries[r->nentries++] = node;
+}
+
+/*
+ * pick the loop headers and branch targets other code may enter the region
+ * at mid-way, the promoted stack slots only hold when it is entered at the
+ * top
+ */
+void ir_entries(ir_region_t *r) {
+    r->nentries = 0;
+    if (r->nslots > 0) return;
+
+    for (u64 i = IR_NODE_ENTRY; i < r->ninsns; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        if (ir->latch != 0) ir_add_entry(r, i);
+        if (ir->op == IR_INSN && ir_is_branch(&ir->insn))
+            ir_add_entry(r, ir_find(r, ir->succs[0]));
+    }
+}
+
+/*
+ * solve which registers each exit has to store and which ones the region
+ * has to load: an exit stores what may be dirty on a path reaching it, the
+ * entry loads what is live, exit stores included.
+ */
+void ir_dataflow(ir_region_t *r) {
+    ir_edges(r);
+
+    for (u64 i = 0; i < r->ninsns; i++) r->insns[i].dirty = 0;
+
+    bool changed;
+    do {
+        changed = false;
+        for (u64 i = 0; i < nedges; i++) {
+            ir_insn_t *from = &r->insns[edges_from[i]];
+            ir_insn_t *to = &r->insns[edges_to[i]];
+            u64 dirty = from->dirty | from->def;
+            if (dirty & ~to->dirty) {
+                to->dirty |= dirty;
+                changed = true;
+            }
+        }
+    } while (changed);
+
+    for (u64 i = 0; i < r->ninsns; i++) {
+        ir_insn_t *ir = &r->insns[i];
+        ir->live = ir->use;
+        if (ir->exit) ir->live |= ir->dirty & ~ir->def;
+        if (ir->charge) ir->live |= ir->dirty;
+    }
+
+    do {
+        changed = false;
+        for (u64 i = nedges; i-- > 0;) {
+            ir_insn_t *from = &r->insns[edges_from[i]];
+            u64 live = r->insns[edges_to[i]].live & ~from->def;
+            if (live & ~from->live) {
+                from->live |= live;
+                changed = true;
+            }
+        }
+    } while (changed);
+}
@@ -1,32 +1,113 @@
 #include "emulator.h"
 
+static void machine_exec(machine_t* m, u8* code) {
+    static const int pinned[JIT_NPINNED] = JIT_PINNED_REGS;
+
+    if (code == (u8*)exec_block_interp) {
+        exec_block_interp(&m->state);
+        // the interpreter only charges the budget, the check is here
+        if (m->state.exit_reason != ECALL &&
+            (m->state.budget < 0 || m->state.interrupt))
+            m->state.exit_reason = INTERRUPT;
+        return;
+    }
+
+    u64* regs = m->state.gp_regs;
+    m->state.chain = 0;
+    ((jit_block_func_t)code)(&m->state, regs[pinned[0]], regs[pinned[1]],
+                             regs[pinned[2]], regs[pinned[3]]);
+}
+
+/* compile the region at pc, making room in the code cache first. with
+ * JIT_ASYNC it is only queued, NULL tells the caller to interpret on */
+static u8* machine_region(machine_t* m, u64 pc) {
+#if JIT_ASYNC
+    if (machine_compiling(m, pc)) return NULL;
+#endif
+    if (cache_full(m->cache)) {
+        cache_flush(m->cache);
+        // the return address stack points into the exit slots
+        memset(m->state.ras, 0, sizeof(m->state.ras));
+    }
+    // generate local instruction code.
+    str_t source = machine_genblock(m, pc);
+#if JIT_ASYNC
+    if (machine_compile_async(m, pc, source)) return NULL;
+#endif
+    return machine_compile(m, pc, source);
+}
+
+/* a region kept leaving through one exit for the same target, re-form it
+ * with the target inside, the new code replaces it in the cache */
+static void machine_extend(machine_t* m) {
+    u64 pc = m->cache->extend.pc;
+    m->cache->extend.pc = 0;
+    if (cache_extend(m->cache, pc, m->cache->extend.target))
+        machine_region(m, pc);
+}
+
+/* the entry profile of a region is complete, specialize the region on the
+ * registers that were near-constant, falling back to its current code */
+static void machine_specialize(machine_t* m) {
+    u64 pc = m->cache->specialize;
+    m->cache->specialize = 0;
+    cache_region_t* region = cache_region(m->cache, pc);
+    // a re-form queued meanwhile restarted the profile for its own code,
+    // the old code finished the previous one
+    if (region->profile == NULL || region->nspecs > 0 ||
+        region->profile[0] != CACHE_PROFILE_COUNT)
+        return;
+#if JIT_ASYNC
+    // specialize once the queued code has profiled itself
+    if (machine_compiling(m, pc)) return;
+#endif
+
+    for (u64 k = 0; k < region->nprofiled; k++) {
+        if (region->profile[2 + 2 * k] > CACHE_SPEC_CHANGES) continue;
+        region->spec_regs[region->nspecs] = region->profiled[k];
+        region->spec_vals[region->nspecs++] = region->profile[1 + 2 * k];
+    }
+    region->profile = NULL;
+    if (region->nspecs == 0) return;
+
+    region->generic = cache_lookup(m->cache, pc);
+    machine_region(m, pc);
+}
+
 enum exit_reason_t machine_step(machine_t* m) {
     while (true) {
         bool hot = true;
 
+#if JIT_ASYNC
+        machine_compile_poll(m);
+#endif
+        if (m->cache->extend.pc != 0) machine_extend(m);
+        if (m->cache->specialize != 0) machine_specialize(m);
+
         u8* code = cache_lookup(m->cache, m->state.pc);
         if (code == NULL) {
             hot = cache_hot(m->cache, m->state.pc);
-            if (hot) {
-                // generate local instruction code.
-                str_t source = machine_genblock(m);
-                code = machine_compile(m, source);
-            }
+            if (hot) code = machine_region(m, m->state.pc);
         }
-        if (!hot) {
+        if (!hot || code == NULL) {
             code = (u8*)exec_block_interp;
         }
 
         while (true) {
             m->state.exit_reason = NONE;
-            ((exec_block_func_t)code)(&m->state);
+            machine_exec(m, code);
             assert(m->state.exit_reason != NONE);
+            if (m->cache->extend.pc != 0 || m->cache->specialize != 0) break;
 
             if (m->state.exit_reason == INDIRECT_JMP ||
                 m->state.exit_reason == DIRECT_JMP) {
                 // in cache
                 code = cache_lookup(m->cache, m->state.reenter_pc);
-                if (code != NULL) continue;
+                if (code != NULL) {
+                    if (m->state.exit_reason == INDIRECT_JMP)
+                        cache_ibtc_add(m->cache, m->state.reenter_pc, code);
+                    continue;
+                }
             }
 
             if (m->state.exit_reason == INTERP) {
@@ -45,12 +126,17 @@ enum exit_reason_t machine_step(machine_t* m) {
                 break;
             case ECALL:
                 return ECALL;
+            case INTERRUPT:
+                return INTERRUPT;
             default:
                 unreachable();
         }
     }
 }
 
+/* stop the guest at its next charged point, safe in a signal handler */
+void machine_interrupt(machine_t* m) { m->state.interrupt = 1; }
+
 /**
  * 加载可执行程序
  */
@@ -87,4 +173,6 @@ void machine_setup(machine_t* m, int argc, char* argv[]) {
 
     m->state.gp_regs[sp] -= 8;  // argc
     mmu_write(m->state.gp_regs[sp], (u8*)&args, sizeof(u64));
+
+    m->state.budget = INT64_MAX;
 }
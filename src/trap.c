@@ -0,0 +1,64 @@
+#define _GNU_SOURCE
+#include "emulator.h"
+
+#if defined(__x86_64__)
+
+static u8 *trap_start;
+static u64 trap_size;
+
+// x86 register numbers to their slots in the signal context
+static const int trap_gregs[16] = {
+    REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+    REG_R8,  REG_R9,  REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+};
+
+/* a compiled block divided by zero or INT_MIN by -1. codegen only emits
+ * div/idiv with a register divisor, so patch in what RISC-V defines for
+ * both the quotient (rax) and remainder (rdx) and step over the divide */
+static void trap_div(int sig, siginfo_t *info, void *ctx) {
+    greg_t *gregs = ((ucontext_t *)ctx)->uc_mcontext.gregs;
+    u8 *ip = (u8 *)gregs[REG_RIP];
+    if (ip < trap_start || ip >= trap_start + trap_size) {
+        // not a guest division, let it fault again and die
+        signal(SIGFPE, SIG_DFL);
+        return;
+    }
+
+    // only the register forms of div (0xf7 /6) and idiv (0xf7 /7) are
+    // patched, anything else faults again with the default action
+    u8 rex = (ip[0] & 0xf0) == 0x40 ? *ip++ : 0;
+    if (ip[0] != 0xf7 || (ip[1] & 0xc0) != 0xc0 || (ip[1] & 0x38) < 0x30) {
+        signal(SIGFPE, SIG_DFL);
+        return;
+    }
+    u64 mask = (rex & 0x8) ? UINT64_MAX : UINT32_MAX;
+    u64 divisor = gregs[trap_gregs[(ip[1] & 0x7) | (rex & 0x1) << 3]] & mask;
+    u64 dividend = gregs[REG_RAX] & mask;
+
+    if (divisor == 0) {
+        gregs[REG_RAX] = mask;
+        gregs[REG_RDX] = dividend;
+    } else {
+        // INT_MIN / -1 overflows, the quotient is the dividend itself
+        gregs[REG_RAX] = dividend;
+        gregs[REG_RDX] = 0;
+    }
+    gregs[REG_RIP] = (greg_t)(ip + 2);
+}
+
+/* handle division faults raised from code in [start, start + size) */
+void trap_div_install(u8 *start, u64 size) {
+    trap_start = start;
+    trap_size = size;
+
+    struct sigaction sa = {0};
+    sa.sa_sigaction = trap_div;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGFPE, &sa, NULL) != 0) {
+        perror("sigaction");
+        exit(1);
+    }
+}
+
+#endif